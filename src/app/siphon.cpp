@@ -1,26 +1,69 @@
+#include "siphon/affinity.h"
 #include "siphon/core.h"
 #include "siphon/init.h"
-#include "siphon/pyenv.h"
+
+#ifdef SIPHON_USE_PYTHON
+    #include "siphon/pyenv.h"
+#endif
+
+#include <caffe2/core/logging.h>
 
 #include <gflags/gflags.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 using namespace std;
+using namespace std::chrono;
 using namespace gflags;
 using namespace siphon;
 
+DEFINE_string(manifest, "", "File of batch jobs, one \"<load> <save> [<save_onnx>]\" per line with \"-\" to skip a stage.");
+DEFINE_int32(jobs, 0, "Number of concurrent jobs in batch mode. Use all cores if not positive.");
+
+struct Job
+{
+    string load;
+    string save;
+    string save_onnx;
+
+    double load_sec = 0;
+    double save_sec = 0;
+    double save_onnx_sec = 0;
+    string error;
+};
+
 void summary()
 {
     ostringstream buf;
+    if (FLAGS_manifest.size())
+        buf << " manifest:  " << FLAGS_manifest << endl;
     if (FLAGS_load.size())
         buf << " load:      " << FLAGS_load << endl;
     if (FLAGS_save.size())
         buf << " save:      " << FLAGS_save << endl;
     if (FLAGS_save_onnx.size())
         buf << " save_onnx: " << FLAGS_save_onnx << endl;
+    if (FLAGS_profile.size())
+        buf << " profile:   " << FLAGS_profile << endl;
+    if (FLAGS_cache.size())
+        buf << " cache:     " << FLAGS_cache << endl;
+    if (FLAGS_calib.size())
+        buf << " calib:     " << FLAGS_calib << endl;
+    if (FLAGS_weights_dtype.size())
+        buf << " weights:   " << FLAGS_weights_dtype << endl;
+    if (FLAGS_py_workers)
+        buf << " py_workers: " << FLAGS_py_workers << endl;
 
     if (buf.str().size())
     {
@@ -32,19 +75,150 @@ void summary()
     }
 }
 
+void configure(Siphon& sp)
+{
+    sp.mmap_weights = FLAGS_mmap_weights;
+    sp.calib_dir = FLAGS_calib;
+    sp.weights_dtype = FLAGS_weights_dtype;
+    sp.cache_dir = FLAGS_cache;
+    sp.net_type = FLAGS_net_type;
+    sp.num_workers = FLAGS_num_workers;
+    sp.cpu_set = parse_cpu_list(FLAGS_cpu_set);
+    sp.intra_op_threads = FLAGS_intra_op_threads;
+}
+
+void run(Job& job)
+{
+    const auto timed = [](double& sec, const function<void()>& f)
+        {
+            const auto begin = steady_clock::now();
+            f();
+            sec = duration<double>(steady_clock::now() - begin).count();
+        };
+
+    Siphon sp;
+    configure(sp);
+    if (job.load.size())
+    {
+        timed(job.load_sec, [&]() { sp.load(job.load); });
+    }
+    if (job.save.size())
+    {
+        timed(job.save_sec, [&]() { sp.save(job.save); });
+    }
+    if (job.save_onnx.size())
+    {
+        timed(job.save_onnx_sec, [&]() { sp.save_onnx(job.save_onnx); });
+    }
+}
+
+vector<Job> read_manifest(const string& fn)
+{
+    ifstream fin(fn);
+    CAFFE_ENFORCE(fin.is_open(), "Failed to open manifest \"" + fn + "\".");
+
+    vector<Job> jobs;
+    for (string line; getline(fin, line);)
+    {
+        istringstream fields(line);
+        vector<string> args;
+        for (string arg; fields >> arg;)
+            args.emplace_back(arg == "-" ? "" : arg);
+        if (args.empty() || line[line.find_first_not_of(" \t")] == '#')
+            continue;
+        CAFFE_ENFORCE(args.size() <= 3, "Too many fields in manifest line \"" + line + "\".");
+        args.resize(3);
+
+        Job job;
+        job.load = args[0];
+        job.save = args[1];
+        job.save_onnx = args[2];
+        jobs.emplace_back(move(job));
+    }
+    return jobs;
+}
+
+int run_batch()
+{
+    auto jobs = read_manifest(FLAGS_manifest);
+    const auto num_workers = min<size_t>(FLAGS_jobs > 0 ? FLAGS_jobs : max(thread::hardware_concurrency(), 1u), jobs.size());
+    LOG(INFO) << "Run " << jobs.size() << " jobs with " << num_workers << " worker(s).";
+
+    const auto begin = steady_clock::now();
+    {
+        // GIL is only held in Python stages, so C++ stages of different jobs run concurrently.
+        atomic<size_t> next(0);
+        vector<thread> workers;
+        for (size_t tid = 0; tid < num_workers; ++tid)
+        {
+            workers.emplace_back([&]()
+                {
+                    for (auto idx = next++; idx < jobs.size(); idx = next++)
+                    {
+                        try
+                        {
+                            run(jobs[idx]);
+                        }
+                        catch (const exception& e)
+                        {
+                            jobs[idx].error = e.what();
+                            LOG(ERROR) << "Job " << idx << " (" << jobs[idx].load << ") failed:\n" << e.what();
+                        }
+                    }
+                });
+        }
+        for (auto& worker : workers)
+            worker.join();
+    }
+    const auto elapsed = duration<double>(steady_clock::now() - begin).count();
+
+    int failed = 0;
+    ostringstream buf;
+    buf << fixed << setprecision(3);
+    buf << left << setw(8) << " job" << right
+        << setw(12) << "load (s)"
+        << setw(12) << "save (s)"
+        << setw(12) << "onnx (s)"
+        << "  status" << endl;
+    for (size_t idx = 0; idx < jobs.size(); ++idx)
+    {
+        const auto& job = jobs[idx];
+        failed += job.error.size() > 0;
+        buf << left << setw(8) << " " + to_string(idx) << right
+            << setw(12) << job.load_sec
+            << setw(12) << job.save_sec
+            << setw(12) << job.save_onnx_sec
+            << "  " << (job.error.size() ? "failed" : "ok") << "  " << job.load << endl;
+    }
+    buf << string(60, '-') << endl;
+    buf << " " << jobs.size() - failed << "/" << jobs.size() << " succeeded in " << elapsed << " s" << endl;
+    cout << string(60, '=') + "\n" + buf.str() + string(60, '=') + "\n" << endl;
+
+    return failed ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
     ParseCommandLineFlags(&argc, &argv, true);
 
     summary();
 
+#ifdef SIPHON_USE_PYTHON
     /*
-     * Extend the life span of embedded python interpreter.
+     * Extend the life span of embedded python interpreter, which is only started on first use.
      * Numpy cannot be loaded twice.
      */
+    PyEnv::workers = FLAGS_py_workers;
     PyEnv pyenv;
+#endif
+
+    if (FLAGS_manifest.size())
+    {
+        return run_batch();
+    }
 
     Siphon sp;
+    configure(sp);
     if (FLAGS_load.size())
     {
         sp.load(FLAGS_load);
@@ -57,6 +231,10 @@ int main(int argc, char *argv[])
     {
         sp.save_onnx(FLAGS_save_onnx);
     }
+    if (FLAGS_profile.size())
+    {
+        sp.profile(FLAGS_profile);
+    }
 
     return 0;
 }
@@ -0,0 +1,211 @@
+#include "siphon/affinity.h"
+#include "siphon/core.h"
+#include "siphon/init.h"
+#include "siphon/server.h"
+
+#ifdef SIPHON_USE_PYTHON
+    #include "siphon/pyenv.h"
+#endif
+
+#include <caffe2/core/logging.h>
+
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+using namespace gflags;
+using namespace siphon;
+
+DEFINE_int32(threads, 1, "Number of concurrent sessions, one per thread.");
+DEFINE_int32(batch, 0, "Batch size of synthesized inputs. Use value info if not positive.");
+DEFINE_int32(warmup, 10, "Number of warmup iterations per thread.");
+DEFINE_int32(iters, 100, "Number of timed iterations per thread.");
+DEFINE_string(levels, "pred,pred_O1,pred_O2,pred_O3,pred_Int8", "Comma-separated predict net levels to compare.");
+DEFINE_bool(numa, false, "Send requests of all threads to a server with one weight replica per NUMA node.");
+DEFINE_int32(node_workers, 1, "Number of server workers per NUMA node with --numa.");
+
+struct Result
+{
+    string lvl;
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double qps = 0;
+};
+
+double percentile(const vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    const auto rank = static_cast<size_t>(ceil(p * sorted.size()));
+    return sorted[min(max(rank, static_cast<size_t>(1)), sorted.size()) - 1];
+}
+
+Result bench(Siphon& sp, const string& lvl)
+{
+    LOG(INFO) << "Benchmark " << lvl << " with " << FLAGS_threads << " thread(s).";
+
+    unique_ptr<Server> server;
+    if (FLAGS_numa)
+    {
+        server = make_unique<Server>(sp, lvl, FLAGS_node_workers);
+    }
+
+    vector<vector<double>> latencies(FLAGS_threads);
+    atomic<int> ready(0);
+    atomic<bool> start(false);
+
+    vector<thread> workers;
+    for (int tid = 0; tid < FLAGS_threads; ++tid)
+    {
+        workers.emplace_back([&, tid]()
+            {
+                const auto inputs = sp.dummy_inputs(FLAGS_batch);
+                function<void()> run;
+                unique_ptr<Session> sess;
+                if (server)
+                {
+                    run = [&]() { server->run(inputs); };
+                }
+                else
+                {
+                    sess = sp.session(lvl, -1, tid, FLAGS_threads);
+                    sess->prepare();
+                    run = [&]() { sess->run(inputs); };
+                }
+
+                for (int i = 0; i < FLAGS_warmup; ++i)
+                    run();
+
+                ++ready;
+                while (!start)
+                    this_thread::yield();
+
+                auto& lat = latencies[tid];
+                lat.reserve(FLAGS_iters);
+                for (int i = 0; i < FLAGS_iters; ++i)
+                {
+                    const auto begin = steady_clock::now();
+                    run();
+                    lat.emplace_back(duration<double, milli>(steady_clock::now() - begin).count());
+                }
+            });
+    }
+
+    while (ready < FLAGS_threads)
+        this_thread::yield();
+    const auto begin = steady_clock::now();
+    start = true;
+    for (auto& worker : workers)
+        worker.join();
+    const auto elapsed = duration<double>(steady_clock::now() - begin).count();
+
+    if (server)
+    {
+        LOG(INFO) << "Server report of " << lvl << ":\n" << server->report();
+    }
+
+    vector<double> all;
+    for (const auto& lat : latencies)
+        all.insert(all.end(), lat.begin(), lat.end());
+    sort(all.begin(), all.end());
+
+    Result res;
+    res.lvl = lvl;
+    res.p50 = percentile(all, 0.50);
+    res.p90 = percentile(all, 0.90);
+    res.p99 = percentile(all, 0.99);
+    res.qps = elapsed > 0 ? all.size() / elapsed : 0;
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    ParseCommandLineFlags(&argc, &argv, true);
+
+    CAFFE_ENFORCE(FLAGS_load.size(), "Missing --load.");
+    CAFFE_ENFORCE_GT(FLAGS_threads, 0, "Need at least one thread.");
+    CAFFE_ENFORCE_GT(FLAGS_iters, 0, "Need at least one iteration.");
+
+#ifdef SIPHON_USE_PYTHON
+    /*
+     * Extend the life span of embedded python interpreter, which is only started on first use.
+     * Numpy cannot be loaded twice.
+     */
+    PyEnv::workers = FLAGS_py_workers;
+    PyEnv pyenv;
+#endif
+
+    Siphon sp;
+    sp.calib_dir = FLAGS_calib;
+    sp.net_type = FLAGS_net_type;
+    sp.num_workers = FLAGS_num_workers;
+    sp.cpu_set = parse_cpu_list(FLAGS_cpu_set);
+    sp.intra_op_threads = FLAGS_intra_op_threads;
+    sp.numa_replicas = FLAGS_numa;
+    sp.load(FLAGS_load);
+    CAFFE_ENFORCE(sp.value_info.size(), "Missing value info for input synthesis.");
+    sp.optimize_c2();
+
+    vector<Result> results;
+    {
+        istringstream levels(FLAGS_levels);
+        for (string lvl; getline(levels, lvl, ',');)
+        {
+            if (lvl.empty())
+                continue;
+            if (!sp.nets.count(lvl))
+            {
+                LOG(WARNING) << "Predict net level \"" << lvl << "\" doesn't exist. Skip.";
+                continue;
+            }
+            results.emplace_back(bench(sp, lvl));
+        }
+    }
+
+    ostringstream buf;
+    buf << " load:    " << FLAGS_load << endl;
+    buf << " threads: " << FLAGS_threads << endl;
+    buf << " batch:   " << (FLAGS_batch > 0 ? to_string(FLAGS_batch) : "value info") << endl;
+    if (FLAGS_net_type.size())
+        buf << " net:     " << FLAGS_net_type << (FLAGS_num_workers > 0 ? " x" + to_string(FLAGS_num_workers) : "") << endl;
+    if (FLAGS_cpu_set.size())
+        buf << " cpus:    " << FLAGS_cpu_set << endl;
+    buf << " iters:   " << FLAGS_iters << " (warmup " << FLAGS_warmup << ")" << endl;
+    buf << string(60, '-') << endl;
+    buf << left << setw(12) << " level" << right
+        << setw(12) << "p50 (ms)"
+        << setw(12) << "p90 (ms)"
+        << setw(12) << "p99 (ms)"
+        << setw(12) << "QPS" << endl;
+    buf << fixed << setprecision(3);
+    for (const auto& res : results)
+    {
+        buf << left << setw(12) << " " + res.lvl << right
+            << setw(12) << res.p50
+            << setw(12) << res.p90
+            << setw(12) << res.p99
+            << setw(12) << res.qps << endl;
+    }
+    cout << string(60, '=') + "\n" + buf.str() + string(60, '=') + "\n" << endl;
+
+    if (FLAGS_profile.size())
+    {
+        sp.profile(FLAGS_profile);
+    }
+
+    return 0;
+}
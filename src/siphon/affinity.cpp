@@ -0,0 +1,99 @@
+#include "siphon/affinity.h"
+
+#include <caffe2/core/logging.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::filesystem;
+
+namespace siphon
+{
+    SIPHON_API
+    vector<int> parse_cpu_list(const string& list)
+    {
+        vector<int> cpus;
+        istringstream fields(list);
+        for (string field; getline(fields, field, ',');)
+        {
+            if (field.find_first_not_of(" \t\n") == string::npos)
+                continue;
+
+            int first = 0;
+            int last = 0;
+            try
+            {
+                const auto dash = field.find('-');
+                first = stoi(field.substr(0, dash));
+                last = dash == string::npos ? first : stoi(field.substr(dash + 1));
+            }
+            catch (const exception&)
+            {
+                CAFFE_THROW("Invalid CPU range \"" + field + "\".");
+            }
+            CAFFE_ENFORCE(0 <= first && first <= last, "Invalid CPU range \"" + field + "\".");
+
+            for (auto cpu = first; cpu <= last; ++cpu)
+                cpus.emplace_back(cpu);
+        }
+        return cpus;
+    }
+
+    SIPHON_API
+    void pin_thread(const vector<int>& cpus)
+    {
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        for (const auto cpu : cpus)
+        {
+            CAFFE_ENFORCE(0 <= cpu && cpu < CPU_SETSIZE, "CPU " + to_string(cpu) + " is out of range.");
+            CPU_SET(cpu, &mask);
+        }
+
+        const auto err = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+        CAFFE_ENFORCE(!err, "Failed to pin thread: " + string(strerror(err)) + ".");
+    }
+
+    SIPHON_API
+    map<int, vector<int>> numa_nodes()
+    {
+        map<int, vector<int>> nodes;
+        const path root = "/sys/devices/system/node";
+        error_code ec;
+        for (const auto& entry : directory_iterator(root, ec))
+        {
+            const auto name = entry.path().filename().string();
+            if (name.compare(0, 4, "node") || name.size() == 4 || name.find_first_not_of("0123456789", 4) != string::npos)
+                continue;
+
+            ifstream fin(entry.path() / "cpulist");
+            string list;
+            if (getline(fin, list))
+            {
+                auto cpus = parse_cpu_list(list);
+                if (cpus.size())
+                    nodes.emplace(stoi(name.substr(4)), move(cpus));
+            }
+        }
+
+        if (nodes.empty())
+        {
+            auto& cpus = nodes[0];
+            for (unsigned cpu = 0; cpu < max(thread::hardware_concurrency(), 1u); ++cpu)
+                cpus.emplace_back(cpu);
+        }
+        return nodes;
+    }
+}
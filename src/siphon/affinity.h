@@ -0,0 +1,22 @@
+#pragma once
+
+#include "siphon/utils.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace siphon
+{
+    // CPUs in Linux list format, e.g. "0-3,8,10-11".
+    SIPHON_API
+    std::vector<int> parse_cpu_list(const std::string& list);
+
+    // Pin calling thread to "cpus". Threads it creates afterwards inherit the affinity.
+    SIPHON_API
+    void pin_thread(const std::vector<int>& cpus);
+
+    // CPUs of every NUMA node from sysfs. All CPUs are on node 0 if NUMA is not reported.
+    SIPHON_API
+    std::map<int, std::vector<int>> numa_nodes();
+}
@@ -1,19 +1,26 @@
 #include "siphon/core.h"
 #include "siphon/init.h"
+#include "siphon/json.h"
+#include "siphon/profiler.h"
 
 #include <caffe2/core/logging.h>
+#include <caffe2/core/operator.h>
+#include <caffe2/core/operator_schema.h>
+#include <caffe2/core/types.h>
 #include <caffe2/utils/proto_utils.h>
 
-#include <onnx/onnx_pb.h>
+#include <c10/util/Half.h>
 
-#include <pybind11/embed.h>
+#include <onnx/onnx_pb.h>
 
+#include <cstring>
 #include <exception>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <locale>
 #include <memory>
-#include <regex>
+#include <random>
 #include <set>
 #include <string>
 #include <tuple>
@@ -21,14 +28,11 @@
 using namespace std;
 using namespace std::filesystem;
 using namespace caffe2;
-using namespace pybind11::literals;
 
 using ::ONNX_NAMESPACE::ModelProto;
 
 namespace siphon
 {
-    namespace py = pybind11;
-
     SIPHON_API
     Siphon::Siphon()
     {
@@ -44,71 +48,138 @@ namespace siphon
         CAFFE_ENFORCE(exists(dir), "Model directory \"" + dir.string() + "\" doesn't exist.");
         CAFFE_ENFORCE(is_directory(dir), "\"" + dir.string() + "\" is not a directory.");
 
-        vector<path> pred_paths;
+        static const set<string> c2_exts{ ".pb", ".pbtxt", ".prototxt" };
+        static const set<string> init_names{ "init", "init_net" };
+        static const set<string> pred_names{ "pred", "predict", "pred_net", "predict_net" };
+        static const set<string> onnx_names{ "model", "net", "network" };
+        static const set<string> value_info_names{ "value_info", "valueinfo" };
+
+        // Detect all files first, so that independent ones can be loaded concurrently.
+        path init_path;
+        path pred_path;
+        path weights_path;
+        path onnx_path;
+        path value_info_path;
+
+        const auto found = [&](path& dst, const path& src, const string& kind)
+            {
+                if (!dst.empty())
+                {
+                    LOG(WARNING) << "Overwriting " << kind << " " << dst << " by " << src << ". Check if multiple models exist within the same directory.";
+                }
+                dst = src;
+            };
 
-        for (const auto& fn : directory_iterator(dir))
+        for (const auto& entry : directory_iterator(dir))
         {
+            const auto& fn = entry.path();
             LOG(INFO) << "Examing " << fn << ".";
 
-            auto name = fn.path().stem().string();
-            auto ext = fn.path().extension().string();
+            auto name = fn.stem().string();
+            auto ext = fn.extension().string();
             for (auto& c : name)
                 c = tolower(c, locale());
             for (auto& c : ext)
                 c = tolower(c, locale());
 
-            const auto& canonical_path = canonical(fn.path());
-
-            if (set<string>{ ".pb", ".pbtxt", ".prototxt" }.count(ext))
+            if (c2_exts.count(ext))
             {
-                if (set<string>{ "init", "init_net" }.count(name))
+                if (init_names.count(name))
                 {
-                    LOG(INFO) << "Found init net " << canonical_path << ".";
-                    auto&& net = load_c2(canonical_path);
-                    net.set_name("init");
-                    if (nets.count(net.name()))
-                    {
-                        LOG(WARNING) << "Overwriting init net. Check if multiple models exist within the same directory.";
-                    }
-                    nets[net.name()] = move(net);
+                    LOG(INFO) << "Found init net " << fn << ".";
+                    found(init_path, fn, "init net");
                 }
-                else if (set<string>{ "pred", "predict", "pred_net", "predict_net" }.count(name))
+                else if (pred_names.count(name))
                 {
-                    LOG(INFO) << "Found predict net " << canonical_path << ".";
-                    auto&& net = load_c2(canonical_path);
-                    net.set_name("pred");
-                    if (nets.count(net.name()))
-                    {
-                        LOG(WARNING) << "Overwriting predict net. Check if multiple models exist within the same directory.";
-                    }
-                    nets[net.name()] = move(net);
+                    LOG(INFO) << "Found predict net " << fn << ".";
+                    found(pred_path, fn, "predict net");
+                }
+                else if (name == "weights" && ext == ".pb")
+                {
+                    LOG(INFO) << "Found weight index " << fn << ".";
+                    found(weights_path, fn, "weight index");
                 }
                 else
                 {
-                    LOG(WARNING) << "Unknown Caffe2 model " << canonical_path << ". Ignore.";
+                    LOG(WARNING) << "Unknown Caffe2 model " << fn << ". Ignore.";
                 }
             }
-            else if (set<string>{ "model", "net", "network" }.count(name) && ext == ".onnx")
+            else if (onnx_names.count(name) && ext == ".onnx")
             {
-                LOG(INFO) << "Found ONNX model " << canonical_path << ".";
-                load_onnx(canonical_path);
+                LOG(INFO) << "Found ONNX model " << fn << ".";
+                found(onnx_path, fn, "ONNX model");
             }
-            else if (set<string>{ "value_info", "valueinfo" }.count(name) && ext == ".json")
+            else if (value_info_names.count(name) && ext == ".json")
             {
-                LOG(INFO) << "Found value info file " << canonical_path << ".";
-                load_value_info(canonical_path);
+                LOG(INFO) << "Found value info file " << fn << ".";
+                found(value_info_path, fn, "value info file");
+            }
+        }
 
-                LOG(INFO) << "Create input blob based on value info:\n" << show_value_info("\t");
+        auto digest_f = async(launch::async, [&]() { digest_input(dir); });
 
-                for (const auto& info : value_info)
+        // Weights are mapped before init net starts, since both create blobs in workspace.
+        if (!weights_path.empty())
+        {
+            load_weights(weights_path);
+        }
+
+        // Init net runs right after parsing, while other files are still loading.
+        future<NetDef> init_f;
+        if (!init_path.empty())
+        {
+            init_f = async(launch::async, [&]()
                 {
-                    BlobSetTensor(ws.CreateBlob(info.first), Tensor(info.second.dims, dev_type));
-                    ws.GetBlob(info.first)->GetMutable<Tensor>()->mutable_data<float>();
-                }
-            }
+                    auto net = load_c2(init_path);
+                    net.set_name("init");
+                    LOG(INFO) << "Run init net.";
+                    ws.RunNetOnce(net);
+                    return net;
+                });
         }
 
-        if (nets.count("init"))
+        future<NetDef> pred_f;
+        if (!pred_path.empty())
+        {
+            pred_f = async(launch::async, [&]()
+                {
+                    auto net = load_c2(pred_path);
+                    net.set_name("pred");
+                    return net;
+                });
+        }
+
+        // ONNX conversion may fall back to python, which stays on the calling thread.
+        if (!onnx_path.empty())
+        {
+            load_onnx(onnx_path);
+        }
+
+        if (!value_info_path.empty())
+        {
+            load_value_info(value_info_path);
+            LOG(INFO) << "Input blobs will be created in sessions based on value info:\n" << show_value_info("\t");
+        }
+
+        const auto replace = [&](NetDef&& net)
+            {
+                if (nets.count(net.name()))
+                {
+                    LOG(WARNING) << "Overwriting " << net.name() << " net. Check if multiple models exist within the same directory.";
+                }
+                nets[net.name()] = move(net);
+            };
+
+        digest_f.get();
+        if (pred_f.valid())
+        {
+            replace(pred_f.get());
+        }
+        if (init_f.valid())
+        {
+            replace(init_f.get());
+        }
+        else if (nets.count("init"))
         {
             LOG(INFO) << "Run init net.";
             ws.RunNetOnce(nets["init"]);
@@ -119,9 +190,6 @@ namespace siphon
         }
 
         CHECK_GT(nets.count("pred"), 0) << "Predict net not found.";
-        LOG(INFO) << "Create predict net.";
-        // ws.CreateNet(nets["pred"]);
-        // ws.RunNet("pred");
 
         LOG(INFO) << "Model loaded successfully.";
     }
@@ -134,6 +202,13 @@ namespace siphon
         CAFFE_ENFORCE(create_directories(dir), "Cannot create output directory \"" + dir.string() + "\".");
         dir = canonical(dir);
 
+        const auto key = fingerprint("c2");
+        if (restore_cache(key, dir))
+        {
+            LOG(INFO) << "Model saved in Caffe2 format from cache successfully.";
+            return;
+        }
+
         if (value_info.size())
         {
             save_value_info(dir / "value_info.json");
@@ -144,25 +219,209 @@ namespace siphon
         }
 
         CAFFE_ENFORCE(nets.count("init"), "Init net doesn't exist.");
-        for (const string lvl : { "_O3", "_O2", "_O1", "" })
+        CAFFE_ENFORCE(nets.count("pred"), "Predict net doesn't exist.");
+        optimize_c2();
+
+        for (const string lvl : { "_Int8", "_O3", "_O2", "_O1", "" })
             if (nets.count("init" + lvl))
             {
-                save_c2(nets["init" + lvl], dir / "init.pb");
+                auto init_net = nets["init" + lvl];
+                const auto use_store = mmap_weights || weights_dtype.size() || (!init_net.op_size() && init_net.external_output_size());
+                if (use_store && lvl != "_Int8")
+                {
+                    save_weights(init_net, dir / "weights.pb");
+                    break;
+                }
+                else if (use_store)
+                {
+                    LOG(WARNING) << "Int8 weights cannot be stored in weight store. Save as init net instead.";
+                }
+
+                // Weights loaded from weight store have no op in init net.
+                set<string> produced;
+                for (const auto& op : init_net.op())
+                    produced.insert(op.output().begin(), op.output().end());
+                for (const auto& name : nets["init" + lvl].external_output())
+                    if (!produced.count(name))
+                        make_fill(name, BlobGetTensor(*ws.GetBlob(name), dev_type), *init_net.mutable_op());
+                save_c2(init_net, dir / "init.pb");
                 break;
             }
 
-        CAFFE_ENFORCE(nets.count("pred"), "Predict net doesn't exist.");
-        optimize_c2();
-        for (const string lvl : { "_O3", "_O2", "_O1", "" })
+        for (const string lvl : { "_Int8", "_O3", "_O2", "_O1", "" })
             if (nets.count("pred" + lvl))
             {
                 save_c2(nets["pred" + lvl], dir / "pred.prototxt");
                 break;
             }
 
+        store_cache(key, dir);
+
         LOG(INFO) << "Model saved in Caffe2 format successfully.";
     }
 
+    SIPHON_API
+    map<string, Tensor> Siphon::dummy_inputs(int batch) const
+    {
+        CAFFE_ENFORCE(value_info.size(), "Missing value info.");
+
+        mt19937 rng(0);
+        uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+        map<string, Tensor> inputs;
+        for (const auto& info : value_info)
+        {
+            // Leading dimension is the batch if it is symbolic or varies among profiles.
+            auto dims = info.second.dims;
+            auto batched = dims.size() && info.second.symbols.size() && info.second.symbols[0].size();
+            for (const auto& profile : info.second.profiles)
+                batched = batched || (profile.size() && profile[0] != dims[0]);
+            if (batch > 0 && batched)
+            {
+                dims[0] = batch;
+            }
+            Tensor tensor(dims, dev_type);
+            const auto fill = [&](auto data, auto gen)
+            {
+                for (int64_t i = 0; i < tensor.numel(); data[i++] = gen());
+            };
+
+            const auto type = c2_type(info.second.type);
+            switch (type)
+            {
+            case TensorProto_DataType_FLOAT:
+                fill(tensor.mutable_data<float>(), [&]() { return dist(rng); });
+                break;
+            case TensorProto_DataType_DOUBLE:
+                fill(tensor.mutable_data<double>(), [&]() { return static_cast<double>(dist(rng)); });
+                break;
+            case TensorProto_DataType_FLOAT16:
+                fill(tensor.mutable_data<at::Half>(), [&]() { return at::Half(dist(rng)); });
+                break;
+            case TensorProto_DataType_BOOL:
+                fill(tensor.mutable_data<bool>(), [&]() { return dist(rng) > 0.0f; });
+                break;
+            case TensorProto_DataType_STRING:
+                tensor.mutable_data<string>();
+                break;
+            default:
+            {
+                // Integers are zero, since they are often indices, which have to be in range.
+                const auto data = tensor.raw_mutable_data(DataTypeToTypeMeta(type));
+                if (tensor.nbytes())
+                    memset(data, 0, tensor.nbytes());
+                break;
+            }
+            }
+            inputs.emplace(info.first, move(tensor));
+        }
+        return inputs;
+    }
+
+    SIPHON_API
+    vector<map<string, vector<int>>> Siphon::buckets() const
+    {
+        size_t num = 0;
+        for (const auto& info : value_info)
+        {
+            const auto& profiles = info.second.profiles;
+            if (profiles.empty())
+                continue;
+            CAFFE_ENFORCE(!num || num == profiles.size(), "Input \"" + info.first + "\" has " + to_string(profiles.size()) + " profiles while others have " + to_string(num) + ".");
+            num = profiles.size();
+        }
+        if (num < 2)
+        {
+            return {};
+        }
+
+        vector<map<string, vector<int>>> ret(num);
+        for (size_t i = 0; i < num; ++i)
+            for (const auto& info : value_info)
+                ret[i][info.first] = info.second.profiles.empty() ? info.second.dims : info.second.profiles[i];
+        return ret;
+    }
+
+    SIPHON_API
+    void Siphon::profile(const path& fn, int iters) const
+    {
+        LOG(INFO) << "Profile predict nets with " << iters << " iteration(s).";
+
+        Profiler prof;
+        const auto inputs = dummy_inputs();
+        for (const auto& net : nets)
+        {
+            // Bucket specializations are covered by sessions of their levels.
+            if (net.first.compare(0, 4, "pred") || net.first.find('@') != string::npos)
+            {
+                continue;
+            }
+
+            auto sess = session(net.first);
+            LOG(INFO) << "Warm up predict net \"" << net.first << "\".";
+            sess->run(inputs);
+            sess->attach(prof);
+            for (int i = 0; i < iters; ++i)
+            {
+                sess->run(inputs);
+            }
+        }
+
+        LOG(INFO) << "Operator profile:\n" << prof.summary();
+        prof.save(fn);
+    }
+
+    SIPHON_API
+    unique_ptr<Session> Siphon::session(const string& lvl, int node, int slot, int slots) const
+    {
+        CAFFE_ENFORCE(nets.count(lvl), "Predict net \"" + lvl + "\" doesn't exist.");
+        CAFFE_ENFORCE(slot >= 0 && slot < slots, "Session slot " + to_string(slot) + " is out of " + to_string(slots) + ".");
+
+        vector<Session::Bucket> buckets;
+        for (auto& dims : this->buckets())
+        {
+            // Fall back to the generic net if the level is not specialized, e.g. after loading a saved model.
+            const auto name = lvl + "@" + to_string(buckets.size());
+            auto net_def = nets.count(name) ? nets.at(name) : nets.at(lvl);
+            net_def.set_name(name);
+            buckets.push_back({ move(net_def), move(dims) });
+        }
+        if (buckets.empty())
+        {
+            auto net_def = nets.at(lvl);
+            net_def.set_name(lvl);
+            buckets.push_back({ move(net_def), {} });
+        }
+
+        CAFFE_ENFORCE(node < 0 || replicas.count(node), "Weights are not replicated on NUMA node " + to_string(node) + ".");
+        const auto& weights = node < 0 ? ws : *replicas.at(node).ws;
+        const auto& cpus = node < 0 ? cpu_set : replicas.at(node).cpus;
+        if (cpus.empty() || slots == 1)
+        {
+            return make_unique<Session>(*this, buckets, weights, cpus, slots);
+        }
+
+        // Contiguous share of CPUs, or a CPU shared round-robin with more slots than CPUs.
+        const auto n = cpus.size();
+        vector<int> share(cpus.begin() + slot * n / slots, cpus.begin() + (slot + 1) * n / slots);
+        if (share.empty())
+        {
+            share.push_back(cpus[slot % n]);
+        }
+        return make_unique<Session>(*this, buckets, weights, share, max(slots / static_cast<int>(n), 1));
+    }
+
+    SIPHON_API
+    map<string, Tensor> Siphon::run(const map<string, Tensor>& inputs, const string& lvl)
+    {
+        auto& sess = sessions[lvl];
+        if (!sess)
+        {
+            sess = session(lvl);
+        }
+        return sess->run(inputs);
+    }
+
     SIPHON_API
     string Siphon::show_value_info(const string& prefix)
     {
@@ -171,16 +430,210 @@ namespace siphon
         {
             if (ret.size())
                 ret += "\n\n";
-            string buf;
-            for (size_t i = 0; i < info.second.dims.size(); buf += to_string(info.second.dims[i++]) + ", ");
-            buf.erase(buf.size() - 2);
+            const auto show_dims = [&](const vector<int>& dims, bool symbolic)
+                {
+                    string buf;
+                    for (size_t i = 0; i < dims.size(); ++i)
+                    {
+                        buf += i ? ", " : "";
+                        if (symbolic && i < info.second.symbols.size() && info.second.symbols[i].size())
+                            buf += info.second.symbols[i] + "=";
+                        buf += to_string(dims[i]);
+                    }
+                    return "[" + buf + "]";
+                };
             ret += prefix + "name: " + info.first
                 + "\n" + prefix + "type: " + onnx::TensorProto_DataType_Name(info.second.type)
-                + "\n"+ prefix + "dims: [" + buf + "]";
+                + "\n"+ prefix + "dims: " + show_dims(info.second.dims, true);
+            for (const auto& profile : info.second.profiles)
+                ret += "\n" + prefix + "profile: " + show_dims(profile, false);
+        }
+        return ret;
+    }
+
+    SIPHON_HIDDEN
+    map<string, TensorShape> Siphon::infer_shapes(const NetDef& net, const map<string, string>& origins) const
+    {
+        CaffeMap<string, vector<int64_t>> blob_dims;
+        CaffeMap<string, TensorProto_DataType> blob_types;
+        for (const auto& info : value_info)
+        {
+            blob_dims[info.first].assign(info.second.dims.begin(), info.second.dims.end());
+            blob_types[info.first] = c2_type(info.second.type);
+        }
+        for (const auto& name : net.external_input())
+        {
+            const auto origin = origins.count(name) ? origins.at(name) : name;
+            if (origin != name && value_info.count(origin))
+            {
+                const auto& info = value_info.at(origin);
+                blob_dims[name].assign(info.dims.begin(), info.dims.end());
+                blob_types[name] = c2_type(info.type);
+                continue;
+            }
+
+            const auto blob = ws.GetBlob(origin);
+            if (blob_dims.count(name) || !blob || !BlobIsTensorType(*blob, dev_type))
+            {
+                continue;
+            }
+            const auto& tensor = blob->Get<Tensor>();
+            blob_dims[name] = tensor.sizes().vec();
+            blob_types[name] = TypeMetaToDataType(tensor.dtype());
+        }
+
+        auto net_copy = net;
+        const auto shapes = InferBlobShapesAndTypesFromMap(blob_dims, blob_types, { &net_copy });
+
+        map<string, TensorShape> ret;
+        for (const auto& shape : shapes.shapes())
+        {
+            if (!shape.unknown_shape())
+            {
+                ret[shape.name()] = shape;
+            }
+        }
+        return ret;
+    }
+
+    SIPHON_HIDDEN
+    map<string, TensorShape> Siphon::peak_shapes(const NetDef& net, const map<string, vector<int>>& input_dims) const
+    {
+        CaffeMap<string, TensorShape> shapes;
+        for (const auto& info : value_info)
+        {
+            const auto dims = input_dims.find(info.first);
+            shapes[info.first] = CreateTensorShape(dims == input_dims.end() ? info.second.dims : dims->second, c2_type(info.second.type));
+        }
+        for (const auto& name : net.external_input())
+        {
+            const auto blob = ws.GetBlob(name);
+            if (shapes.count(name) || !blob || !BlobIsTensorType(*blob, dev_type))
+            {
+                continue;
+            }
+            const auto& tensor = blob->Get<Tensor>();
+            shapes[name] = CreateTensorShape(tensor.sizes().vec(), TypeMetaToDataType(tensor.dtype()));
+        }
+
+        // Walk ops in order, since blobs may be written more than once with different shapes.
+        map<string, TensorShape> ret;
+        for (const auto& op : net.op())
+        {
+            vector<TensorShape> inputs;
+            for (const auto& input : op.input())
+            {
+                if (!shapes.count(input))
+                    break;
+                inputs.emplace_back(shapes.at(input));
+            }
+
+            vector<TensorShape> outputs;
+            const auto schema = OpSchemaRegistry::Schema(op.type());
+            if (schema && static_cast<int>(inputs.size()) == op.input_size())
+            {
+                try
+                {
+                    outputs = schema->InferTensor(op, inputs);
+                }
+                catch (const exception&)
+                {
+                    outputs.clear();
+                }
+            }
+
+            for (int i = 0; i < op.output_size(); ++i)
+            {
+                const auto& name = op.output(i);
+                if (i >= static_cast<int>(outputs.size()) || outputs[i].unknown_shape())
+                {
+                    shapes.erase(name);
+                    continue;
+                }
+                shapes[name] = outputs[i];
+                if (!ret.count(name) || nbytes(outputs[i]) > nbytes(ret.at(name)))
+                {
+                    ret[name] = outputs[i];
+                }
+            }
         }
         return ret;
     }
 
+    SIPHON_HIDDEN
+    int64_t Siphon::nbytes(const TensorShape& shape)
+    {
+        int64_t ret = DataTypeToTypeMeta(shape.data_type()).itemsize();
+        for (const auto dim : shape.dims())
+            ret *= dim;
+        return ret;
+    }
+
+    SIPHON_HIDDEN
+    TensorProto_DataType Siphon::c2_type(onnx::TensorProto_DataType type)
+    {
+        switch (type)
+        {
+        case onnx::TensorProto_DataType_FLOAT:
+            return TensorProto_DataType_FLOAT;
+        case onnx::TensorProto_DataType_UINT8:
+            return TensorProto_DataType_UINT8;
+        case onnx::TensorProto_DataType_INT8:
+            return TensorProto_DataType_INT8;
+        case onnx::TensorProto_DataType_UINT16:
+            return TensorProto_DataType_UINT16;
+        case onnx::TensorProto_DataType_INT16:
+            return TensorProto_DataType_INT16;
+        case onnx::TensorProto_DataType_INT32:
+            return TensorProto_DataType_INT32;
+        case onnx::TensorProto_DataType_INT64:
+            return TensorProto_DataType_INT64;
+        case onnx::TensorProto_DataType_STRING:
+            return TensorProto_DataType_STRING;
+        case onnx::TensorProto_DataType_BOOL:
+            return TensorProto_DataType_BOOL;
+        case onnx::TensorProto_DataType_FLOAT16:
+            return TensorProto_DataType_FLOAT16;
+        case onnx::TensorProto_DataType_DOUBLE:
+            return TensorProto_DataType_DOUBLE;
+        default:
+            CAFFE_THROW("Unsupported ONNX type ", onnx::TensorProto_DataType_Name(type), ".");
+        }
+    }
+
+    SIPHON_HIDDEN
+    onnx::TensorProto_DataType Siphon::onnx_type(TensorProto_DataType type)
+    {
+        switch (type)
+        {
+        case TensorProto_DataType_FLOAT:
+            return onnx::TensorProto_DataType_FLOAT;
+        case TensorProto_DataType_BYTE:
+        case TensorProto_DataType_UINT8:
+            return onnx::TensorProto_DataType_UINT8;
+        case TensorProto_DataType_INT8:
+            return onnx::TensorProto_DataType_INT8;
+        case TensorProto_DataType_UINT16:
+            return onnx::TensorProto_DataType_UINT16;
+        case TensorProto_DataType_INT16:
+            return onnx::TensorProto_DataType_INT16;
+        case TensorProto_DataType_INT32:
+            return onnx::TensorProto_DataType_INT32;
+        case TensorProto_DataType_INT64:
+            return onnx::TensorProto_DataType_INT64;
+        case TensorProto_DataType_STRING:
+            return onnx::TensorProto_DataType_STRING;
+        case TensorProto_DataType_BOOL:
+            return onnx::TensorProto_DataType_BOOL;
+        case TensorProto_DataType_FLOAT16:
+            return onnx::TensorProto_DataType_FLOAT16;
+        case TensorProto_DataType_DOUBLE:
+            return onnx::TensorProto_DataType_DOUBLE;
+        default:
+            CAFFE_THROW("Unsupported Caffe2 type ", TensorProto_DataType_Name(type), ".");
+        }
+    }
+
     SIPHON_HIDDEN
     void Siphon::load_value_info(path fn)
     {
@@ -188,41 +641,115 @@ namespace siphon
         CAFFE_ENFORCE(exists(fn), "Value-info file \"" + fn.string() + "\" doesn't exist.");
         CAFFE_ENFORCE(!is_directory(fn), "Get directory \"" + fn.string() + "\" while expecting value-info file.");
 
-        string json;
+        ifstream fin(fn);
+        CAFFE_ENFORCE(fin.is_open(), "Cannot open \"" + fn.string() + "\".");
+        const auto json = Json::parse(fin, fn.string());
+        CAFFE_ENFORCE(json.type == Json::Type::Object, "Value info in " + fn.string() + " is " + Json::type_name(json.type) + " instead of object.");
+
+        /*
+         * Each input is either in the short form:
+         *     "name": [type, [dims...]]
+         * or in the object form:
+         *     "name": { "type": type, "dims": [dims...], "profiles": [[dims...], ...] }
+         * Type is an ONNX data type in number or name, e.g. 1 or "FLOAT".
+         * Dims are numbers, or names of symbolic dims, e.g. "batch".
+         */
+        for (const auto& entry : json.object)
         {
-            ifstream fin(fn);
-            CAFFE_ENFORCE(fin.is_open(), "Cannot open \"" + fn.string() + "\".");
-            for (string buf; fin >> buf; json += buf + "\n");
-        }
-
-        smatch mt_multi;
-        CAFFE_ENFORCE(regex_match(json, mt_multi, gr_multi), "Syntax error in \"" + fn.string() + "\":\n" + string(80, '-') + "\n" + json + "\n" + string(80, '-'));
-        CHECK_EQ(mt_multi.size(), 2) << "Wrong number of matched components.";
+            const auto& name = entry.first;
+            const auto fail = [&](const string& msg)
+                {
+                    CAFFE_THROW("Invalid value info of \"" + name + "\" in " + fn.string() + ": " + msg + ".");
+                };
 
-        {
-            sregex_iterator iter_single(mt_multi[1].first, mt_multi[1].second, gr_single, regex_constants::match_continuous);
-            auto single_str = static_cast<string>(mt_multi[1]);
-            auto pending_size = single_str.size();
-            for (const sregex_iterator end; iter_single != end; ++iter_single)
+            const Json* type_json = nullptr;
+            const Json* dims_json = nullptr;
+            const Json* profiles_json = nullptr;
+            if (entry.second.type == Json::Type::Array && entry.second.array.size() == 2)
             {
-                pending_size -= iter_single->str().size();
-                CHECK_EQ(iter_single->size(), 4) << "Wrong number of matched components.";
+                type_json = &entry.second.array[0];
+                dims_json = &entry.second.array[1];
+            }
+            else if (entry.second.type == Json::Type::Object)
+            {
+                for (const auto& member : entry.second.object)
+                    if (member.first != "type" && member.first != "dims" && member.first != "profiles")
+                        LOG(WARNING) << "Unknown field \"" << member.first << "\" in value info of \"" << name << "\". Ignore.";
+                type_json = entry.second.find("type");
+                dims_json = entry.second.find("dims");
+                profiles_json = entry.second.find("profiles");
+            }
+            else
+            {
+                fail("expect [type, dims] or object, got " + Json::type_name(entry.second.type));
+            }
 
-                auto& info = value_info[(*iter_single)[1]];
-                info.type = static_cast<onnx::TensorProto_DataType>(stoi((*iter_single)[2]));
-                sregex_iterator iter_dim((*iter_single)[3].first, (*iter_single)[3].second, gr_dim, regex_constants::match_continuous);
-                auto dims_str = static_cast<string>((*iter_single)[3]);
-                auto pending_size = dims_str.size();
-                for (const sregex_iterator end; iter_dim != end; ++iter_dim)
+            ValueInfo info;
+            if (!type_json)
+                fail("missing type");
+            else if (type_json->is_int())
+            {
+                if (!onnx::TensorProto_DataType_IsValid(static_cast<int>(type_json->number)))
+                    fail("invalid type " + to_string(static_cast<int>(type_json->number)));
+                info.type = static_cast<onnx::TensorProto_DataType>(static_cast<int>(type_json->number));
+            }
+            else if (type_json->type != Json::Type::String)
+                fail("type is " + Json::type_name(type_json->type) + " instead of integer or string");
+            else if (!onnx::TensorProto_DataType_Parse(type_json->str, &info.type))
+                fail("invalid type \"" + type_json->str + "\"");
+
+            if (!dims_json)
+                fail("missing dims");
+            if (dims_json->type != Json::Type::Array)
+                fail("dims is " + Json::type_name(dims_json->type) + " instead of array");
+            auto symbolic = false;
+            for (const auto& dim : dims_json->array)
+            {
+                if (dim.is_int() && dim.number >= 0)
                 {
-                    pending_size -= iter_dim->str().size();
-                    CHECK_EQ(iter_dim->size(), 2) << "Wrong number of matched components.";
+                    info.dims.emplace_back(static_cast<int>(dim.number));
+                    info.symbols.emplace_back();
+                }
+                else if (dim.type == Json::Type::String && dim.str.size())
+                {
+                    info.dims.emplace_back(1);
+                    info.symbols.emplace_back(dim.str);
+                    symbolic = true;
+                }
+                else
+                {
+                    fail("dim is " + Json::type_name(dim.type) + " instead of non-negative integer or symbol");
+                }
+            }
+            if (!symbolic)
+                info.symbols.clear();
 
-                    info.dims.emplace_back(stoi((*iter_dim)[1]));
+            if (profiles_json)
+            {
+                if (profiles_json->type != Json::Type::Array)
+                    fail("profiles is " + Json::type_name(profiles_json->type) + " instead of array");
+                for (const auto& profile_json : profiles_json->array)
+                {
+                    if (profile_json.type != Json::Type::Array || profile_json.array.size() != info.dims.size())
+                        fail("profile is not an array of " + to_string(info.dims.size()) + " dims");
+                    vector<int> profile;
+                    for (size_t i = 0; i < info.dims.size(); ++i)
+                    {
+                        const auto& dim = profile_json.array[i];
+                        if (!dim.is_int() || dim.number < 0)
+                            fail("dim of profile is not a non-negative integer");
+                        profile.emplace_back(static_cast<int>(dim.number));
+                        if (info.symbols.empty() || info.symbols[i].empty())
+                            if (profile.back() != info.dims[i])
+                                fail("profile conflicts with fixed dim " + to_string(i));
+                    }
+                    info.profiles.emplace_back(move(profile));
                 }
-                CHECK_EQ(pending_size, 0) << "Syntax error (cannot parse the entire input) in " << fn << ":\n" + string(80, '-') + "\n" + dims_str + "\n" + string(80, '-');
+                if (info.profiles.size())
+                    info.dims = info.profiles.front();
             }
-            CHECK_EQ(pending_size, 0) << "Syntax error (cannot parse the entire input) in " << fn << ":\n" + string(80, '-') + "\n" + single_str + "\n" + string(80, '-');
+
+            value_info[name] = move(info);
         }
     }
 
@@ -231,18 +758,50 @@ namespace siphon
     {
         if (value_info.size())
         {
+            const auto write_dims = [](ostream& out, const vector<int>& dims, const vector<string>& symbols)
+                {
+                    out << "[";
+                    for (size_t i = 0; i < dims.size(); ++i)
+                    {
+                        out << (i ? ", " : "");
+                        if (i < symbols.size() && symbols[i].size())
+                            out << "\"" << Json::escape(symbols[i]) << "\"";
+                        else
+                            out << dims[i];
+                    }
+                    out << "]";
+                };
+
             ofstream fout(fn);
             CAFFE_ENFORCE(fout.is_open(), "Failed to open \"" + fn.string() + "\".");
             fout << "{" << endl;
             auto remain = value_info.size();
             for (const auto& info : value_info)
             {
-                fout << "    \"" << info.first << "\": [" << static_cast<int>(info.second.type) << ", [";
-                for (size_t i = 0; i < info.second.dims.size(); ++i)
+                fout << "    \"" << Json::escape(info.first) << "\": ";
+                if (info.second.symbols.empty() && info.second.profiles.empty())
                 {
-                    fout << (i ? ", " : "") << info.second.dims[i];
+                    fout << "[" << static_cast<int>(info.second.type) << ", ";
+                    write_dims(fout, info.second.dims, {});
+                    fout << "]";
+                }
+                else
+                {
+                    fout << "{ \"type\": " << static_cast<int>(info.second.type) << ", \"dims\": ";
+                    write_dims(fout, info.second.dims, info.second.symbols);
+                    if (info.second.profiles.size())
+                    {
+                        fout << ", \"profiles\": [";
+                        for (size_t i = 0; i < info.second.profiles.size(); ++i)
+                        {
+                            fout << (i ? ", " : "");
+                            write_dims(fout, info.second.profiles[i], {});
+                        }
+                        fout << "]";
+                    }
+                    fout << " }";
                 }
-                fout << "]]" << (--remain ? "," : "") << endl;
+                fout << (--remain ? "," : "") << endl;
             }
             fout << "}" << endl;
             CAFFE_ENFORCE(fout, "Failied to write to \"" + fn.string() + "\".");
@@ -1,8 +1,12 @@
 #pragma once
 
-#include "siphon/pyenv.h"
+#include "siphon/session.h"
 #include "siphon/utils.h"
 
+#ifdef SIPHON_USE_PYTHON
+    #include "siphon/pyenv.h"
+#endif
+
 #include <c10/core/Device.h>
 
 #include <caffe2/core/net.h>
@@ -10,10 +14,10 @@
 
 #include <onnx/onnx_pb.h>
 
+#include <cstdint>
 #include <filesystem>
 #include <map>
 #include <memory>
-#include <regex>
 #include <string>
 #include <vector>
 
@@ -22,8 +26,14 @@ namespace siphon
     class Siphon
     {
     public:
+        using ModelProto = onnx::ModelProto;
+
         using NetDef = caffe2::NetDef;
 
+        using Tensor = caffe2::Tensor;
+
+        using TensorShape = caffe2::TensorShape;
+
         using Workspace = caffe2::Workspace;
 
         template <typename K, typename V>
@@ -31,8 +41,6 @@ namespace siphon
 
         using path = std::filesystem::path;
 
-        using regex = std::regex;
-
         using string = std::string;
 
         template <typename T>
@@ -56,45 +64,261 @@ namespace siphon
         SIPHON_API
         string show_value_info(const string& prefix = "");
 
-        Workspace ws;
+        /*
+         * Optimize Caffe2 nets into levels stored in "nets":
+         *     O1: graph-level optimizations.
+         *     O2: O1 with memory planning.
+         *     O3: O1 with op fusion and init-only subgraphs folded into init net, and then memory planning.
+         *     Int8: O3 quantized into Caffe2 int8 ops with scales calibrated on "calib_dir", if set.
+         * Memory-planned levels are also specialized for every shape bucket i as "<level>@<i>".
+         * New constants are also created in workspace.
+         */
+        SIPHON_API
+        void optimize_c2();
+
+        /*
+         * Random inputs typed and shaped per value info. Integer inputs are zero, and string inputs are empty.
+         * Leading dimension is replaced by "batch" if positive, for inputs whose leading dimension is symbolic or varies among profiles.
+         */
+        SIPHON_API
+        map<string, Tensor> dummy_inputs(int batch = 0) const;
+
+        /*
+         * Input dims of every shape bucket, bucket i taking the i-th profile of each input with profiles.
+         * Empty unless value info has at least two profiles.
+         */
+        SIPHON_API
+        vector<map<string, vector<int>>> buckets() const;
+
+        /*
+         * Time all operators of every predict net level on dummy inputs.
+         * Summary by op type and op instance is logged, and Chrome trace is saved to "fn".
+         */
+        SIPHON_API
+        void profile(const path& fn, int iters = 10) const;
+
+        /*
+         * Create an inference session for predict net at level "lvl".
+         * With shape buckets, each run is routed to the smallest bucket that fits, using "<lvl>@<i>" if specialized.
+         * Sessions share weights with this object and can run concurrently, one per thread.
+         * With "node" set, weights are shared from the replica on that NUMA node, and threads are pinned to its CPUs.
+         * If "slots" sessions run concurrently on the same CPUs, e.g. workers of a server, this one takes "slot" of them.
+         * Pinned CPUs are split evenly among slots, otherwise intra-op threads are divided among them.
+         */
+        SIPHON_API
+        unique_ptr<Session> session(const string& lvl = "pred", int node = -1, int slot = 0, int slots = 1) const;
+
+        /*
+         * Copy weights into one replica per NUMA node, on threads pinned to the node, so that pages are local by first touch.
+         * Only nodes with CPUs in "cpu_set", if set, are replicated. Return replicated nodes, empty with a single node.
+         * Existing replicas are reused, since sessions may depend on them, so call it again only after weights are final.
+         */
+        SIPHON_API
+        vector<int> replicate();
+
+        /*
+         * Run predict net at level "lvl" in a default session, which is created on first use.
+         * Not thread-safe. Use one session per thread instead for concurrent inference.
+         */
+        SIPHON_API
+        map<string, Tensor> run(const map<string, Tensor>& inputs, const string& lvl = "pred");
+
         map<string, NetDef> nets;
 
         c10::DeviceType dev_type = c10::DeviceType::CPU;
 
+        // Save weights as an aligned raw data file memory-mapped on load, instead of init.pb.
+        bool mmap_weights = false;
+
+        // Store float weights as "fp16" or "bf16" in weight store, expanded to float on load. Empty to keep float.
+        string weights_dtype;
+
+        /*
+         * Directory caching outputs of save() and save_onnx(), keyed by fingerprint of inputs and settings.
+         * Has to be set before load(). Empty to disable.
+         */
+        path cache_dir;
+
+        // Directory of calibration inputs in TensorProtos (*.pb) for int8 quantization.
+        path calib_dir;
+
+        /*
+         * Executor of predict nets in sessions, e.g. "simple", "dag" or "async_scheduling". Empty to keep net type.
+         * Memory-planned nets always run as simple nets, since they reuse buffers in op order.
+         */
+        string net_type;
+
+        // Inter-op worker threads of non-simple executors. Caffe2 default if not positive.
+        int num_workers = 0;
+
+        // CPUs to pin threads running sessions to, as well as executor workers they create. Empty to not pin.
+        vector<int> cpu_set;
+
+        // Intra-op OpenMP threads of threads running sessions. Divide cores evenly among inter-op workers if not positive.
+        int intra_op_threads = 0;
+
+        // Serve with one weight replica per NUMA node in Server.
+        bool numa_replicas = false;
+
         struct ValueInfo
         {
             onnx::TensorProto_DataType type;
+
+            // Concrete dims. Symbolic dims take values from the first profile, or 1 without profiles.
             vector<int> dims;
+
+            // Names of dims, e.g. "batch", and empty for fixed dims. May be empty if all dims are fixed.
+            vector<string> symbols;
+
+            // Concrete shapes to specialize for, which agree with "dims" on fixed dims.
+            vector<vector<int>> profiles;
         };
         
         map<string, ValueInfo> value_info;
 
     private:
+        friend class Session;
+
+        struct QParams
+        {
+            float scale;
+            int zero_point;
+        };
+
+        struct Replica
+        {
+            vector<int> cpus;
+            unique_ptr<Workspace> ws;
+        };
+
+        // Materialize fill ops without inputs into GivenTensor*Fill ops.
         SIPHON_HIDDEN
         NetDef& eval_fill(NetDef& net) const;
 
+        // Append ops filling blob "name" with the content of "tensor".
+        SIPHON_HIDDEN
+        void make_fill(const string& name, const Tensor& tensor, google::protobuf::RepeatedPtrField<caffe2::OperatorDef>& ops) const;
+
         SIPHON_HIDDEN
         static NetDef load_c2(path fn);
 
         SIPHON_HIDDEN
         static void save_c2(const NetDef& net, path fn);
 
+        // Share buffers among intermediate blobs with disjoint live ranges, sized for "input_dims" over value info.
         SIPHON_HIDDEN
-        void optimize_c2();
+        NetDef plan_memory(const NetDef& init_net, const NetDef& pred_net, const map<string, vector<int>>& input_dims = {}) const;
+
+        // Fold SpatialBN into preceding Conv weights, and fuse Relu into Conv.
+        SIPHON_HIDDEN
+        bool fuse_ops(NetDef& init_net, NetDef& pred_net);
+
+        // Evaluate ops depending only on init net outputs, and move results to init net.
+        SIPHON_HIDDEN
+        bool fold_constants(NetDef& init_net, NetDef& pred_net);
+
+        // Remove init net ops and outputs no longer used by predict net.
+        SIPHON_HIDDEN
+        void prune_init(NetDef& init_net, NetDef& pred_net) const;
+
+        // Uint8 quantization covering [lo, hi] and 0.
+        SIPHON_HIDDEN
+        static QParams choose_qparams(float lo, float hi);
+
+        // Quantization of float activations from histograms collected over calibration inputs.
+        SIPHON_HIDDEN
+        map<string, QParams> calibrate(const NetDef& pred_net) const;
+
+        // Rewrite supported ops into int8 ops, with quantized weights added to init net.
+        SIPHON_HIDDEN
+        bool quantize(NetDef& init_net, NetDef& pred_net, const map<string, QParams>& qparams);
+
+        // Digest all files of model directory for cache lookup.
+        SIPHON_HIDDEN
+        void digest_input(const path& dir);
+
+        // Cache key of outputs in "format", from inputs, value info, settings, versions of Siphon, its cache schema and libraries.
+        SIPHON_HIDDEN
+        string fingerprint(const string& format) const;
+
+        SIPHON_HIDDEN
+        bool restore_cache(const string& key, const path& dir) const;
+
+        SIPHON_HIDDEN
+        void store_cache(const string& key, const path& dir) const;
+
+        SIPHON_HIDDEN
+        void load_weights(path fn);
+
+        SIPHON_HIDDEN
+        void save_weights(const NetDef& init_net, const path& fn) const;
 
         SIPHON_HIDDEN
         void load_onnx(path dir);
 
+        SIPHON_HIDDEN
+        bool import_onnx(ModelProto& onnx_model, NetDef& init_net, NetDef& pred_net);
+
+        SIPHON_HIDDEN
+        bool export_onnx(ModelProto& onnx_model);
+
+        // Shapes and types of blobs in "net" inferred from value info and weights.
+        // External inputs renamed in "net" are looked up by their names in "origins", e.g. after SSA rewrite.
+        SIPHON_HIDDEN
+        map<string, TensorShape> infer_shapes(const NetDef& net, const map<string, string>& origins = {}) const;
+
+        // Largest shape of every blob written by ops in "net", for blobs written more than once.
+        // Dims of inputs are taken from "input_dims" if found, or value info otherwise.
+        SIPHON_HIDDEN
+        map<string, TensorShape> peak_shapes(const NetDef& net, const map<string, vector<int>>& input_dims = {}) const;
+
+        SIPHON_HIDDEN
+        static int64_t nbytes(const TensorShape& shape);
+
+        SIPHON_HIDDEN
+        static caffe2::TensorProto_DataType c2_type(onnx::TensorProto_DataType type);
+
+        SIPHON_HIDDEN
+        static onnx::TensorProto_DataType onnx_type(caffe2::TensorProto_DataType type);
+
         SIPHON_HIDDEN
         void load_value_info(path fn);
 
         SIPHON_HIDDEN
         void save_value_info(const path& fn);
 
+#ifdef SIPHON_USE_PYTHON
         PyEnv pyenv;
+#endif
+
+        // Memory-mapped weight data, which has to outlive workspace.
+        std::shared_ptr<void> weights_map;
+
+        // Outputs of init net, shared read-only by all sessions.
+        Workspace ws;
+
+        // Copies of "ws" by NUMA node, falling back to "ws" for blobs not copied.
+        map<int, Replica> replicas;
+
+        map<string, unique_ptr<Session>> sessions;
+
+        // Digest of loaded model directory, or empty if not cacheable.
+        string input_digest;
+
+        static const int onnx_opset_version = 9;
+
+        // Bump whenever conversion, optimization or saved formats change, so that cached outputs are rebuilt.
+        static const int cache_schema_version = 1;
+
+        static const int64_t weights_alignment = 64;
+
+        static const int fill_seed = 0x5EED;
+
+        static const int calib_bins = 2048;
+
+        static constexpr double calib_percentile = 99.99;
 
-        static const regex gr_multi;
-        static const regex gr_single;
-        static const regex gr_dim;
+        // Argument marking nets with buffers shared by plan_memory().
+        static constexpr const char* memory_planned_arg = "siphon_memory_planned";
     };
 }
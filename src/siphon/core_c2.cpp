@@ -5,9 +5,9 @@
 #include <caffe2/opt/optimizer.h>
 #include <caffe2/utils/proto_utils.h>
 
-#include <pybind11/embed.h>
-
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <locale>
@@ -18,115 +18,209 @@ using namespace std;
 using namespace std::filesystem;
 
 using namespace caffe2;
-using namespace pybind11::literals;
+
+using google::protobuf::RepeatedPtrField;
 
 namespace siphon
 {
-    namespace py = pybind11;
-
     SIPHON_HIDDEN
     NetDef& Siphon::eval_fill(NetDef& net) const
     {
-        for (int64_t op_idx = 0; op_idx < net.op_size(); ++op_idx)
+        static const set<string> fill_types{
+            "ConstantFill",
+            "DiagonalFill",
+            "GaussianFill",
+            "MSRAFill",
+            "RangeFill",
+            "UniformFill",
+            "UniformIntFill",
+            "XavierFill"
+        };
+
+        // Scratch workspace shared by all ops. Outputs are removed once materialized.
+        Workspace tmp_ws;
+
+        RepeatedPtrField<OperatorDef> ops;
+        ops.Reserve(net.op_size());
+
+        for (int op_idx = 0; op_idx < net.op_size(); ++op_idx)
         {
             auto& op = *net.mutable_op(op_idx);
-            if (!op.has_type())
+            if (!fill_types.count(op.type()) || op.input_size() || !op.output_size())
             {
+                *ops.Add() = move(op);
                 continue;
             }
-            if (!op.output_size())
+
+            LOG(INFO) << "Evaluate " << op.type() << " op for \"" << op.output(0) << "\".";
+
+            // Random fills are evaluated with fixed seeds for reproducible models.
+            auto eval_op = op;
+            if (!eval_op.device_option().has_random_seed())
             {
-                continue;
+                eval_op.mutable_device_option()->set_random_seed(fill_seed + op_idx);
             }
+            CAFFE_ENFORCE(tmp_ws.RunOperatorOnce(eval_op), "Failed to evaluate " + op.type() + " op.");
 
-            if (op.type() == "ConstantFill")
+            for (const auto& output : op.output())
             {
-                LOG(INFO) << "Evaluate op:\n" + op.DebugString();
-
-                Workspace tmp_ws;
-                tmp_ws.RunOperatorOnce(op);
-
-                for (int64_t output_idx = 0; output_idx < op.output_size(); ++output_idx)
+                const auto first = ops.size();
+                make_fill(output, BlobGetTensor(*tmp_ws.GetBlob(output), dev_type), ops);
+                if (op.has_name())
                 {
-                    const auto& output = op.output(output_idx);
-
-                    auto& tensor = *BlobGetMutableTensor(tmp_ws.GetBlob(output), dev_type);
-                    const auto& dtype = TypeMetaToDataType(tensor.dtype());
-
-                    OperatorDef dst_op;
-                    dst_op.add_output(output);
-                    if (op.has_name())
-                    {
-                        dst_op.set_name(op.name());
-                    }
-                    {
-                        auto& arg = *dst_op.add_arg();
-                        arg.set_name("dtype");
-                        arg.set_i(static_cast<long long>(dtype));
-                    }
+                    for (auto i = first; i < ops.size(); ++i)
                     {
-                        auto& arg = *dst_op.add_arg();
-                        arg.set_name("values");
-                        const auto numel = static_cast<size_t>(tensor.numel());
-                        switch (dtype)
-                        {
-                        case caffe2::TensorProto_DataType_FLOAT:
-                            {
-                                dst_op.set_type("GivenTensorFill");
-                                LOG(INFO) << "Generate " << dst_op.type() << " op.";
-                                const auto data = tensor.data<float>();
-                                for (size_t i = 0; i < numel; arg.add_floats(data[i++]));
-                            }
-                            break;
-                        case caffe2::TensorProto_DataType_INT32:
-                            {
-                                dst_op.set_type("GivenTensorIntFill");
-                                LOG(INFO) << "Generate " << dst_op.type() << " op.";
-                                const auto data = tensor.data<int>();
-                                for (size_t i = 0; i < numel; arg.add_ints(data[i++]));
-                            }
-                            break;
-                        case caffe2::TensorProto_DataType_INT64:
-                            {
-                                dst_op.set_type("GivenTensorInt64Fill");
-                                LOG(INFO) << "Generate " << dst_op.type() << " op.";
-                                const auto data = tensor.data<int64_t>();
-                                for (size_t i = 0; i < numel; arg.add_ints(data[i++]));
-                            }
-                            break;
-                        case caffe2::TensorProto_DataType_DOUBLE:
-                            {
-                                dst_op.set_type("GivenTensorDoubleFill");
-                                LOG(INFO) << "Generate " << dst_op.type() << " op.";
-                                const auto data = tensor.data<double>();
-                                for (size_t i = 0; i < numel; arg.add_floats(data[i++]));
-                            }
-                            break;
-                        default:
-                            LOG(FATAL) << "Unsupported type " << caffe2::TensorProto_DataType_Name(dtype) << ".";
-                        }
-                    }
-                    {
-                        auto& device_option = *dst_op.mutable_device_option();
-                        device_option.set_device_type(static_cast<int>(dev_type));
-                    }
-
-                    if (output_idx)
-                    {
-                        LOG(INFO) << "Append new op to network.";
-                        *(net.add_op()) = move(dst_op);
-                    }
-                    else
-                    {
-                        LOG(INFO) << "Inject new op in-place.";
-                        op = move(dst_op);
+                        ops.Mutable(i)->set_name(op.name());
                     }
                 }
+                tmp_ws.RemoveBlob(output);
             }
         }
+
+        net.mutable_op()->Swap(&ops);
         return net;
     }
 
+    SIPHON_HIDDEN
+    void Siphon::make_fill(const string& name, const Tensor& tensor, RepeatedPtrField<OperatorDef>& ops) const
+    {
+        const auto dtype = TypeMetaToDataType(tensor.dtype());
+        const auto numel = static_cast<int>(tensor.numel());
+
+        auto& op = *ops.Add();
+        op.add_output(name);
+        op.mutable_device_option()->set_device_type(static_cast<int>(dev_type));
+        {
+            auto& arg = *op.add_arg();
+            arg.set_name("shape");
+            for (const auto dim : tensor.sizes())
+            {
+                arg.add_ints(dim);
+            }
+        }
+        auto& arg = *op.add_arg();
+        arg.set_name("values");
+
+        // Types without GivenTensor*Fill are filled in a wider type and casted by an extra op.
+        const auto cast = [&](const string& type, const string& cast_type, int to = 0)
+            {
+                const auto tmp = name + "_" + type;
+                op.set_output(0, tmp);
+                auto& cast_op = *ops.Add();
+                cast_op.set_type(cast_type);
+                cast_op.add_input(tmp);
+                cast_op.add_output(name);
+                *cast_op.mutable_device_option() = op.device_option();
+                if (to)
+                {
+                    auto& to_arg = *cast_op.add_arg();
+                    to_arg.set_name("to");
+                    to_arg.set_i(to);
+                }
+            };
+
+        switch (dtype)
+        {
+        case TensorProto_DataType_FLOAT:
+            {
+                op.set_type("GivenTensorFill");
+                auto& values = *arg.mutable_floats();
+                values.Resize(numel, 0);
+                if (numel)
+                    memcpy(values.mutable_data(), tensor.data<float>(), tensor.nbytes());
+            }
+            break;
+        case TensorProto_DataType_DOUBLE:
+            {
+                op.set_type("GivenTensorDoubleFill");
+                auto& values = *arg.mutable_floats();
+                values.Resize(numel, 0);
+                copy_n(tensor.data<double>(), numel, values.mutable_data());
+            }
+            break;
+        case TensorProto_DataType_FLOAT16:
+            {
+                op.set_type("GivenTensorFill");
+                auto& values = *arg.mutable_floats();
+                values.Resize(numel, 0);
+                const auto data = tensor.data<at::Half>();
+                transform(data, data + numel, values.mutable_data(), [](const at::Half& x) { return static_cast<float>(x); });
+                cast(op.type(), "FloatToHalf");
+            }
+            break;
+        case TensorProto_DataType_INT64:
+            {
+                op.set_type("GivenTensorInt64Fill");
+                auto& values = *arg.mutable_ints();
+                values.Resize(numel, 0);
+                if (numel)
+                    memcpy(values.mutable_data(), tensor.data<int64_t>(), tensor.nbytes());
+            }
+            break;
+        case TensorProto_DataType_INT32:
+            {
+                op.set_type("GivenTensorIntFill");
+                auto& values = *arg.mutable_ints();
+                values.Resize(numel, 0);
+                copy_n(tensor.data<int>(), numel, values.mutable_data());
+            }
+            break;
+        case TensorProto_DataType_INT16:
+            {
+                op.set_type("GivenTensorInt16Fill");
+                auto& values = *arg.mutable_ints();
+                values.Resize(numel, 0);
+                copy_n(tensor.data<int16_t>(), numel, values.mutable_data());
+            }
+            break;
+        case TensorProto_DataType_UINT16:
+            {
+                op.set_type("GivenTensorIntFill");
+                auto& values = *arg.mutable_ints();
+                values.Resize(numel, 0);
+                copy_n(tensor.data<uint16_t>(), numel, values.mutable_data());
+                cast(op.type(), "Cast", TensorProto_DataType_UINT16);
+            }
+            break;
+        case TensorProto_DataType_INT8:
+            {
+                op.set_type("GivenTensorIntFill");
+                auto& values = *arg.mutable_ints();
+                values.Resize(numel, 0);
+                copy_n(tensor.data<int8_t>(), numel, values.mutable_data());
+                cast(op.type(), "Cast", TensorProto_DataType_INT8);
+            }
+            break;
+        case TensorProto_DataType_BYTE:
+        case TensorProto_DataType_UINT8:
+            {
+                op.set_type("GivenTensorByteStringToUInt8Fill");
+                arg.add_strings(static_cast<const char*>(tensor.raw_data()), tensor.nbytes());
+            }
+            break;
+        case TensorProto_DataType_BOOL:
+            {
+                op.set_type("GivenTensorBoolFill");
+                auto& values = *arg.mutable_ints();
+                values.Resize(numel, 0);
+                copy_n(tensor.data<bool>(), numel, values.mutable_data());
+            }
+            break;
+        case TensorProto_DataType_STRING:
+            {
+                op.set_type("GivenTensorStringFill");
+                const auto data = tensor.data<string>();
+                arg.mutable_strings()->Reserve(numel);
+                for (int i = 0; i < numel; arg.add_strings(data[i++]));
+            }
+            break;
+        default:
+            CAFFE_THROW("Unsupported type ", TensorProto_DataType_Name(dtype), " of \"", name, "\".");
+        }
+
+        LOG(INFO) << "Generate " << op.type() << " op for \"" << name << "\".";
+    }
+
     SIPHON_HIDDEN
     NetDef Siphon::load_c2(path fn)
     {
@@ -165,7 +259,7 @@ namespace siphon
         }
     }
 
-    SIPHON_HIDDEN
+    SIPHON_API
     void Siphon::optimize_c2()
     {
         string init_lvl = "init";
@@ -174,94 +268,76 @@ namespace siphon
         CAFFE_ENFORCE(nets.count("init"), "Init net doesn't exist.");
         CAFFE_ENFORCE(nets.count("pred"), "Predict net doesn't exist.");
 
+        nets["init_O1"] = opt::optimize(nets["init"]);
+        if (nets["init_O1"].SerializeAsString() != nets["init"].SerializeAsString())
         {
-            const auto& before = nets["pred"].DebugString();
-            nets["init_O1"] = opt::optimize(nets["init"]);
-            const auto& after = nets["pred"].DebugString();
-            if (before != after)
-            {
-                LOG(INFO) << "Init network optimized with graph optimization.";
-                init_lvl = "init_O1";
-            }
+            LOG(INFO) << "Init network optimized with graph optimization.";
+            init_lvl = "init_O1";
         }
 
+        nets["pred_O1"] = opt::optimize(nets["pred"]);
+        if (nets["pred_O1"].SerializeAsString() != nets["pred"].SerializeAsString())
         {
-            const auto& before = nets["pred"].DebugString();
-            nets["pred_O1"] = opt::optimize(nets["pred"]);
-            const auto& after = nets["pred"].DebugString();
-            if (before != after)
-            {
-                LOG(INFO) << "Predict network optimized with graph optimization.";
-                init_lvl = "pred_O1";
-            }
+            LOG(INFO) << "Predict network optimized with graph optimization.";
+            pred_lvl = "pred_O1";
         }
 
-        string init_str;
-        string pred_str;
-        nets[init_lvl].SerializeToString(&init_str);
-        nets[pred_lvl].SerializeToString(&pred_str);
+        // Memory planning depends on shapes, so every bucket gets its own plan.
+        const auto buckets = this->buckets();
+        const auto specialize = [&](const string& lvl, const NetDef& init_net, const NetDef& pred_net)
+            {
+                for (size_t i = 0; i < buckets.size(); ++i)
+                    nets[lvl + "@" + to_string(i)] = plan_memory(init_net, pred_net, buckets[i]);
+                if (buckets.size())
+                    LOG(INFO) << "Predict network " << lvl << " specialized for " << buckets.size() << " shape buckets.";
+            };
 
-        set<string> static_blobs;
-        for (const auto& blob_name : nets[pred_lvl].external_input())
-            static_blobs.emplace(blob_name);
-        for (const auto& blob_name : nets[pred_lvl].external_output())
-            static_blobs.emplace(blob_name);
-        auto input_blobs = static_blobs;
-        for (const auto& blob_name : nets[init_lvl].external_output())
         {
-            static_blobs.emplace(blob_name);
-            input_blobs.erase(blob_name);
+            auto pred_opt = plan_memory(nets[init_lvl], nets[pred_lvl]);
+            if (pred_opt.SerializeAsString() == nets[pred_lvl].SerializeAsString())
+                LOG(INFO) << "No memory planning available for predict network.";
+            else
+            {
+                nets["pred_O2"] = move(pred_opt);
+                LOG(INFO) << "Predict network optimized with memory planning.";
+                specialize("pred_O2", nets[init_lvl], nets[pred_lvl]);
+            }
         }
 
-        string pred_opt_str;
-
-        pyenv.exec([&]()
+        auto init_opt = nets[init_lvl];
+        auto pred_opt = nets[pred_lvl];
+        {
+            const auto fused = fuse_ops(init_opt, pred_opt);
+            const auto folded = fold_constants(init_opt, pred_opt);
+            if (folded)
+                LOG(INFO) << "Init-only subgraphs moved from predict network to init network.";
+            if (fused || folded)
             {
-                py::list static_blobs_py;
-                for (const auto& blob_name : static_blobs)
-                    static_blobs_py.append(blob_name);
-
-                py::list input_blobs_py;
-                for (const auto& blob_name : input_blobs)
-                    input_blobs_py.append(blob_name);
-
-                auto proto_module = pyenv.import("caffe2.proto.caffe2_pb2");
-                auto memonger_module = pyenv.import("caffe2.python.memonger");
-
-                LOG(INFO) << "Deserialize init network in python.";
-                auto init_py = proto_module.attr("NetDef")();
-                init_py.attr("ParseFromString")(py::bytes(init_str));
-
-                LOG(INFO) << "Deserialize predict network in python.";
-                auto pred_py = proto_module.attr("NetDef")();
-                pred_py.attr("ParseFromString")(py::bytes(pred_str));
-
-                LOG(INFO) << "Optimizing predict network in python.";
-                auto optimize_interference = memonger_module.attr("optimize_interference");
-                auto optimize_inference_fast = memonger_module.attr("optimize_inference_fast");
-                auto optimize_inference_for_dag = memonger_module.attr("optimize_inference_for_dag");
-                auto pred_opt_tuple_py = optimize_interference(pred_py, static_blobs_py);
-                auto pred_opt_py = pred_opt_tuple_py.attr("net");
-                // auto pred_opt_py = optimize_inference_fast(pred_py, static_blobs_py);
-                // auto pred_opt_py = optimize_inference_for_dag(pred_py, input_blobs_py);
-
-                LOG(INFO) << "Serialize predict network and send back to C++.";
-                {
-                    py::bytes pred_opt_str_py = pred_opt_py.attr("SerializeToString")();
-                    pred_opt_str = static_cast<string>(pred_opt_str_py);
-                }
-            });
+                prune_init(init_opt, pred_opt);
+                nets["pred_O3"] = plan_memory(init_opt, pred_opt);
+                nets["init_O3"] = init_opt;
+                specialize("pred_O3", init_opt, pred_opt);
+            }
+            else
+            {
+                LOG(INFO) << "No op fusion or constant folding available for predict network.";
+            }
+        }
 
-        if (pred_opt_str == pred_str)
-            LOG(INFO) << "No memonger optimzation available for predict network.";
-        else
+        if (!calib_dir.empty())
         {
-            LOG(INFO) << "Deserialize predict network in C++.";
-            NetDef pred_opt;
-            CAFFE_ENFORCE(ParseProtoFromLargeString(pred_opt_str, &pred_opt), "Failed to deserialize optimized predict network.");
-            nets["pred_O2"] = pred_opt;
-            LOG(INFO) << "Predict network optimized with memonger.";
-            pred_lvl = "pred_O2";
+            if (quantize(init_opt, pred_opt, calibrate(pred_opt)))
+            {
+                LOG(INFO) << "Predict network quantized into int8.";
+                prune_init(init_opt, pred_opt);
+                nets["pred_Int8"] = plan_memory(init_opt, pred_opt);
+                specialize("pred_Int8", init_opt, pred_opt);
+                nets["init_Int8"] = move(init_opt);
+            }
+            else
+            {
+                LOG(INFO) << "No int8 quantization available for predict network.";
+            }
         }
     }
 }
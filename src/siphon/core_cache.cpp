@@ -0,0 +1,285 @@
+#include "siphon/core.h"
+
+#include <caffe2/core/logging.h>
+#include <caffe2/core/macros.h>
+
+#include <onnx/defs/schema.h>
+#include <onnx/onnx_pb.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifndef SIPHON_VERSION
+    #define SIPHON_VERSION "unknown"
+#endif
+
+using namespace std;
+using namespace std::filesystem;
+
+namespace siphon
+{
+    // SHA-256, to address cache entries by content.
+    class Sha256
+    {
+    public:
+        void update(const void* data, size_t size)
+        {
+            auto bytes = static_cast<const uint8_t*>(data);
+            length += size;
+            while (size)
+            {
+                if (!used && size >= sizeof(block))
+                {
+                    compress(bytes);
+                    bytes += sizeof(block);
+                    size -= sizeof(block);
+                    continue;
+                }
+                const auto n = min(size, sizeof(block) - used);
+                memcpy(block + used, bytes, n);
+                used += n;
+                bytes += n;
+                size -= n;
+                if (used == sizeof(block))
+                {
+                    compress(block);
+                    used = 0;
+                }
+            }
+        }
+
+        // Length-prefixed to keep concatenations unambiguous.
+        void update(const string& str)
+        {
+            const auto size = static_cast<uint64_t>(str.size());
+            update(&size, sizeof(size));
+            update(str.data(), str.size());
+        }
+
+        // Finish and return digest in hex. No more updates afterwards.
+        string hex_digest()
+        {
+            const auto bits = length * 8;
+            const uint8_t one = 0x80;
+            const uint8_t zero = 0;
+            update(&one, 1);
+            while (used != sizeof(block) - 8)
+                update(&zero, 1);
+            for (int i = 7; i >= 0; --i)
+            {
+                const auto byte = static_cast<uint8_t>(bits >> (i * 8));
+                update(&byte, 1);
+            }
+
+            ostringstream buf;
+            buf << hex << setfill('0');
+            for (const auto word : state)
+                buf << setw(8) << word;
+            return buf.str();
+        }
+
+    private:
+        static uint32_t rotr(uint32_t x, int n)
+        {
+            return (x >> n) | (x << (32 - n));
+        }
+
+        void compress(const uint8_t* p)
+        {
+            static const uint32_t k[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+            };
+
+            uint32_t w[64];
+            for (int i = 0; i < 16; ++i)
+                w[i] = static_cast<uint32_t>(p[i * 4]) << 24 | static_cast<uint32_t>(p[i * 4 + 1]) << 16 | static_cast<uint32_t>(p[i * 4 + 2]) << 8 | p[i * 4 + 3];
+            for (int i = 16; i < 64; ++i)
+            {
+                const auto s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                const auto s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            auto a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+            for (int i = 0; i < 64; ++i)
+            {
+                const auto t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+                const auto t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+            state[5] += f;
+            state[6] += g;
+            state[7] += h;
+        }
+
+        uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+        uint8_t block[64];
+        size_t used = 0;
+        uint64_t length = 0;
+    };
+
+    // Digest of names and contents of regular files directly in "dir", as scanned by load(), hashed in parallel.
+    static string digest_dir(const path& dir)
+    {
+        map<string, future<string>> digests;
+        for (const auto& entry : directory_iterator(dir))
+        {
+            if (!entry.is_regular_file())
+                continue;
+
+            digests.emplace(entry.path().filename().string(), async(launch::async, [fn = entry.path()]()
+                {
+                    ifstream fin(fn, ios::binary);
+                    CAFFE_ENFORCE(fin.is_open(), "Failed to open \"" + fn.string() + "\".");
+                    Sha256 sha;
+                    vector<char> buf(1 << 20);
+                    while (fin)
+                    {
+                        fin.read(buf.data(), buf.size());
+                        sha.update(buf.data(), static_cast<size_t>(fin.gcount()));
+                    }
+                    return sha.hex_digest();
+                }));
+        }
+
+        Sha256 sha;
+        for (auto& digest : digests)
+        {
+            sha.update(digest.first);
+            sha.update(digest.second.get());
+        }
+        return sha.hex_digest();
+    }
+
+    SIPHON_HIDDEN
+    void Siphon::digest_input(const path& dir)
+    {
+        input_digest = cache_dir.empty() ? "" : digest_dir(dir);
+    }
+
+    SIPHON_HIDDEN
+    string Siphon::fingerprint(const string& format) const
+    {
+        // Release version alone doesn't change with the code between releases.
+        Sha256 sha;
+        sha.update(SIPHON_VERSION);
+        sha.update(to_string(cache_schema_version));
+        sha.update(format);
+        sha.update(input_digest);
+
+        // Conversion path and libraries, since native and Python fallback conversions differ.
+#ifdef SIPHON_USE_PYTHON
+        sha.update("python");
+#else
+        sha.update("native");
+#endif
+        sha.update(to_string(CAFFE2_VERSION));
+        sha.update(to_string(::ONNX_NAMESPACE::IR_VERSION));
+        sha.update(to_string(::ONNX_NAMESPACE::OpSchemaRegistry::DomainToVersionRange::Instance().Map().at(::ONNX_NAMESPACE::ONNX_DOMAIN).second));
+
+        for (const auto& info : value_info)
+        {
+            sha.update(info.first);
+            const auto type = static_cast<int>(info.second.type);
+            sha.update(&type, sizeof(type));
+            for (const auto dim : info.second.dims)
+                sha.update(&dim, sizeof(dim));
+            for (const auto& symbol : info.second.symbols)
+                sha.update(symbol);
+            for (const auto& profile : info.second.profiles)
+                for (const auto dim : profile)
+                    sha.update(&dim, sizeof(dim));
+        }
+
+        // Settings affecting outputs.
+        sha.update(to_string(mmap_weights));
+        sha.update(weights_dtype);
+        sha.update(to_string(onnx_opset_version));
+        sha.update(calib_dir.empty() ? "" : digest_dir(calib_dir));
+
+        return sha.hex_digest();
+    }
+
+    SIPHON_HIDDEN
+    bool Siphon::restore_cache(const string& key, const path& dir) const
+    {
+        if (cache_dir.empty() || input_digest.empty())
+        {
+            return false;
+        }
+
+        const auto entry = cache_dir / key;
+        if (!is_directory(entry))
+        {
+            LOG(INFO) << "Cache miss for " << key << ".";
+            return false;
+        }
+
+        LOG(INFO) << "Cache hit for " << key << ". Copy outputs from " << entry << ".";
+        copy(entry, dir, copy_options::recursive | copy_options::overwrite_existing);
+        return true;
+    }
+
+    SIPHON_HIDDEN
+    void Siphon::store_cache(const string& key, const path& dir) const
+    {
+        if (cache_dir.empty() || input_digest.empty())
+        {
+            return;
+        }
+
+        create_directories(cache_dir);
+        const auto entry = cache_dir / key;
+
+        // Copy to a private directory first, so that concurrent writers never expose a partial entry.
+        ostringstream tmp_name;
+        tmp_name << key << ".tmp." << getpid() << "." << this_thread::get_id();
+        const auto tmp = cache_dir / tmp_name.str();
+        remove_all(tmp);
+        copy(dir, tmp, copy_options::recursive);
+
+        error_code ec;
+        rename(tmp, entry, ec);
+        if (ec)
+        {
+            remove_all(tmp);
+            LOG(INFO) << "Cache entry " << key << " exists already.";
+        }
+        else
+        {
+            LOG(INFO) << "Cache outputs as " << entry << ".";
+        }
+    }
+}
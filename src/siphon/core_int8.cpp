@@ -0,0 +1,439 @@
+#include "siphon/core.h"
+
+#include <caffe2/core/blob_serialization.h>
+#include <caffe2/core/logging.h>
+#include <caffe2/core/operator.h>
+#include <caffe2/utils/proto_utils.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace std::filesystem;
+using namespace caffe2;
+
+using google::protobuf::RepeatedPtrField;
+
+namespace siphon
+{
+    SIPHON_HIDDEN
+    Siphon::QParams Siphon::choose_qparams(float lo, float hi)
+    {
+        lo = min(lo, 0.f);
+        hi = max(hi, 0.f);
+        QParams qp;
+        qp.scale = hi > lo ? (hi - lo) / 255 : 1.f;
+        qp.zero_point = static_cast<int>(min(max(round(-lo / qp.scale), 0.f), 255.f));
+        return qp;
+    }
+
+    SIPHON_HIDDEN
+    map<string, Siphon::QParams> Siphon::calibrate(const NetDef& pred_net) const
+    {
+        vector<path> fns;
+        for (const auto& entry : directory_iterator(canonical(calib_dir)))
+            if (entry.path().extension() == ".pb")
+                fns.emplace_back(entry.path());
+        sort(fns.begin(), fns.end());
+        CAFFE_ENFORCE(fns.size(), "No calibration input found in " + calib_dir.string() + ".");
+
+        LOG(INFO) << "Calibrate predict network with " << fns.size() << " input(s) from " << calib_dir << ".";
+
+        Workspace calib_ws(&ws);
+        unique_ptr<NetBase> net;
+
+        set<string> names;
+        for (const auto& info : value_info)
+            names.emplace(info.first);
+        for (const auto& op : pred_net.op())
+            names.insert(op.output().begin(), op.output().end());
+
+        // Feed inputs and visit every float activation after the run.
+        const auto run = [&](const path& fn, const function<void(const string&, const float*, int64_t)>& visit)
+            {
+                TensorProtos protos;
+                CAFFE_ENFORCE(ReadProtoFromFile(fn.string(), &protos), "Failed to read calibration input \"" + fn.string() + "\".");
+                for (const auto& proto : protos.protos())
+                {
+                    CAFFE_ENFORCE(value_info.count(proto.name()), "Calibration input \"" + proto.name() + "\" is not found in value info.");
+                    BlobProto blob_proto;
+                    blob_proto.set_name(proto.name());
+                    blob_proto.set_type("Tensor");
+                    *blob_proto.mutable_tensor() = proto;
+                    DeserializeBlob(blob_proto, calib_ws.CreateBlob(proto.name()));
+                }
+
+                if (!net)
+                {
+                    auto calib_net = pred_net;
+                    calib_net.set_name("calib");
+                    net = calib_ws.CreateNet(calib_net);
+                    CAFFE_ENFORCE(net, "Failed to create predict net for calibration.");
+                }
+                CAFFE_ENFORCE(net->Run(), "Failed to run predict net on \"" + fn.string() + "\".");
+
+                for (const auto& name : names)
+                {
+                    const auto blob = calib_ws.GetBlob(name);
+                    if (!blob || !BlobIsTensorType(*blob, dev_type))
+                        continue;
+                    const auto& tensor = BlobGetTensor(*blob, dev_type);
+                    if (tensor.IsType<float>() && tensor.numel())
+                        visit(name, tensor.data<float>(), tensor.numel());
+                }
+            };
+
+        map<string, pair<float, float>> ranges;
+        for (const auto& fn : fns)
+            run(fn, [&](const string& name, const float* data, int64_t size)
+                {
+                    auto& range = ranges.emplace(name, make_pair(numeric_limits<float>::max(), numeric_limits<float>::lowest())).first->second;
+                    const auto minmax = minmax_element(data, data + size);
+                    range.first = min(range.first, *minmax.first);
+                    range.second = max(range.second, *minmax.second);
+                });
+
+        // Histograms over the full range, to clip outliers by percentile.
+        map<string, vector<int64_t>> hists;
+        for (const auto& fn : fns)
+            run(fn, [&](const string& name, const float* data, int64_t size)
+                {
+                    const auto lo = min(ranges.at(name).first, 0.f);
+                    const auto hi = max(ranges.at(name).second, 0.f);
+                    auto& hist = hists[name];
+                    hist.resize(calib_bins);
+                    if (hi <= lo)
+                        return;
+                    for (int64_t i = 0; i < size; ++i)
+                    {
+                        const auto bin = static_cast<int64_t>((data[i] - lo) / (hi - lo) * calib_bins);
+                        ++hist[min(max(bin, static_cast<int64_t>(0)), static_cast<int64_t>(calib_bins - 1))];
+                    }
+                });
+
+        map<string, QParams> qparams;
+        for (const auto& entry : hists)
+        {
+            const auto lo = min(ranges.at(entry.first).first, 0.f);
+            const auto hi = max(ranges.at(entry.first).second, 0.f);
+            const auto& hist = entry.second;
+
+            int64_t total = 0;
+            for (const auto count : hist)
+                total += count;
+            const auto tail = static_cast<int64_t>(total * (1 - calib_percentile / 100) / 2);
+
+            int begin = 0;
+            for (int64_t acc = 0; begin < calib_bins - 1 && acc + hist[begin] <= tail; ++begin)
+                acc += hist[begin];
+            int end = calib_bins;
+            for (int64_t acc = 0; end > begin + 1 && acc + hist[end - 1] <= tail; --end)
+                acc += hist[end - 1];
+
+            const auto width = (hi - lo) / calib_bins;
+            qparams[entry.first] = choose_qparams(lo + begin * width, lo + end * width);
+        }
+
+        LOG(INFO) << "Calibrated " << qparams.size() << " activations.";
+        return qparams;
+    }
+
+    SIPHON_HIDDEN
+    bool Siphon::quantize(NetDef& init_net, NetDef& pred_net, const map<string, QParams>& qparams)
+    {
+        if (!CPUOperatorRegistry()->Has("Int8Conv"))
+        {
+            LOG(WARNING) << "Int8 operators are not available in Caffe2. Skip quantization.";
+            return false;
+        }
+
+        set<string> used;
+        map<string, int> writes;
+        for (const auto& op : pred_net.op())
+        {
+            used.insert(op.input().begin(), op.input().end());
+            used.insert(op.output().begin(), op.output().end());
+            for (const auto& output : op.output())
+                ++writes[output];
+        }
+        used.insert(pred_net.external_input().begin(), pred_net.external_input().end());
+        used.insert(init_net.external_output().begin(), init_net.external_output().end());
+
+        const auto unique_name = [&](const string& base)
+            {
+                auto name = base;
+                while (used.count(name) || ws.HasBlob(name))
+                    name += "_";
+                used.emplace(name);
+                return name;
+            };
+
+        const auto const_float = [&](const string& name) -> const Tensor*
+            {
+                if (writes.count(name) || !ws.HasBlob(name) || !BlobIsTensorType(*ws.GetBlob(name), dev_type))
+                    return nullptr;
+                const auto& tensor = BlobGetTensor(*ws.GetBlob(name), dev_type);
+                return tensor.IsType<float>() ? &tensor : nullptr;
+            };
+
+        const auto get_arg = [](const OperatorDef& op, const string& name) -> const Argument*
+            {
+                for (const auto& arg : op.arg())
+                    if (arg.name() == name)
+                        return &arg;
+                return nullptr;
+            };
+
+        RepeatedPtrField<OperatorDef> ops;
+        const auto add_op = [&](const string& type, const vector<string>& inputs, const vector<string>& outputs, const vector<Argument>& args = {}) -> OperatorDef&
+            {
+                auto& op = *ops.Add();
+                op = CreateOperatorDef(type, "", inputs, outputs, args);
+                op.mutable_device_option()->set_device_type(static_cast<int>(dev_type));
+                return op;
+            };
+
+        // Weights are created in workspace right away, so that predict net can be used without rerunning init net.
+        const auto add_fill = [&](const string& type, const string& name, const vector<int64_t>& dims, const Argument& values, const QParams& qp)
+            {
+                auto& op = *init_net.add_op();
+                op = CreateOperatorDef(type, "", {}, { name }, {
+                    MakeArgument<vector<int64_t>>("shape", dims),
+                    values,
+                    MakeArgument<float>("Y_scale", qp.scale),
+                    MakeArgument<int>("Y_zero_point", qp.zero_point) });
+                op.mutable_device_option()->set_device_type(static_cast<int>(dev_type));
+                CAFFE_ENFORCE(ws.RunOperatorOnce(op), "Failed to create int8 weight \"" + name + "\".");
+                init_net.add_external_output(name);
+                pred_net.add_external_input(name);
+            };
+
+        // Quantized weights in NHWC for Conv, keyed by float weight name.
+        map<string, pair<string, QParams>> weights;
+        const auto quantize_weight = [&](const string& name, const Tensor& w, bool nhwc)
+            {
+                if (weights.count(name))
+                    return weights.at(name);
+
+                const auto src = w.data<float>();
+                const auto minmax = minmax_element(src, src + w.numel());
+                const auto qp = choose_qparams(*minmax.first, *minmax.second);
+
+                auto dims = w.sizes().vec();
+                string values(w.numel(), '\0');
+                const auto inner = dims.size() == 4 ? dims[2] * dims[3] : 1;
+                const auto channels = dims.size() == 4 ? dims[1] : 1;
+                for (int64_t i = 0; i < w.numel(); ++i)
+                {
+                    // [M, C, kH, kW] -> [M, kH, kW, C]
+                    auto dst = i;
+                    if (nhwc)
+                    {
+                        const auto m = i / (channels * inner);
+                        const auto c = i / inner % channels;
+                        const auto hw = i % inner;
+                        dst = (m * inner + hw) * channels + c;
+                    }
+                    const auto q = round(src[i] / qp.scale) + qp.zero_point;
+                    values[dst] = static_cast<char>(static_cast<uint8_t>(min(max(q, 0.f), 255.f)));
+                }
+                if (nhwc)
+                    dims = { dims[0], dims[2], dims[3], dims[1] };
+
+                const auto q_name = unique_name(name + "_int8");
+                add_fill("Int8GivenTensorFill", q_name, dims, MakeArgument<string>("values", values), qp);
+                return weights[name] = make_pair(q_name, qp);
+            };
+
+        const auto quantize_bias = [&](const string& name, const Tensor* b, int64_t size, float scale)
+            {
+                QParams qp;
+                qp.scale = scale;
+                qp.zero_point = 0;
+                vector<int> values(size);
+                for (int64_t i = 0; b && i < size; ++i)
+                    values[i] = static_cast<int>(round(b->data<float>()[i] / scale));
+                const auto q_name = unique_name(name + "_int8");
+                add_fill("Int8GivenIntTensorFill", q_name, { size }, MakeArgument<vector<int>>("values", values), qp);
+                return q_name;
+            };
+
+        struct Quantized
+        {
+            string name;
+            bool nhwc;
+            QParams qp;
+        };
+
+        // Latest int8 version of float blobs, and float blobs only up-to-date in int8.
+        map<string, Quantized> int8;
+        set<string> stale;
+
+        const auto float_input = [&](const string& name)
+            {
+                if (stale.count(name))
+                {
+                    const auto& q = int8.at(name);
+                    if (q.nhwc)
+                    {
+                        const auto tmp = unique_name(name + "_nhwc");
+                        add_op("Int8Dequantize", { q.name }, { tmp });
+                        add_op("NHWC2NCHW", { tmp }, { name });
+                    }
+                    else
+                    {
+                        add_op("Int8Dequantize", { q.name }, { name });
+                    }
+                    stale.erase(name);
+                }
+                return name;
+            };
+
+        const auto int8_input = [&](const string& name, bool nhwc)
+            {
+                if (int8.count(name) && int8.at(name).nhwc == nhwc)
+                    return int8.at(name);
+
+                auto src = float_input(name);
+                if (nhwc)
+                {
+                    const auto tmp = unique_name(name + "_nhwc");
+                    add_op("NCHW2NHWC", { src }, { tmp });
+                    src = tmp;
+                }
+                Quantized q{ unique_name(src + "_int8"), nhwc, qparams.at(name) };
+                add_op("Int8Quantize", { src }, { q.name }, {
+                    MakeArgument<float>("Y_scale", q.qp.scale),
+                    MakeArgument<int>("Y_zero_point", q.qp.zero_point) });
+                return int8[name] = q;
+            };
+
+        const auto int8_output = [&](const string& name, bool nhwc, const QParams& qp)
+            {
+                Quantized q{ unique_name(name + "_int8"), nhwc, qp };
+                int8[name] = q;
+                stale.emplace(name);
+                return q;
+            };
+
+        const auto copy_args = [](const OperatorDef& op, OperatorDef& q_op, const QParams& qp, bool nhwc)
+            {
+                for (const auto& arg : op.arg())
+                    if (arg.name() != "order")
+                        *q_op.add_arg() = arg;
+                if (nhwc)
+                    *q_op.add_arg() = MakeArgument<string>("order", "NHWC");
+                *q_op.add_arg() = MakeArgument<float>("Y_scale", qp.scale);
+                *q_op.add_arg() = MakeArgument<int>("Y_zero_point", qp.zero_point);
+            };
+
+        int quantized = 0;
+        for (const auto& op : pred_net.op())
+        {
+            const auto order = get_arg(op, "order");
+            const auto nchw = !order || order->s() == "NCHW";
+            const auto plain = op.engine().empty() && op.output_size() == 1 && op.input_size() >= 1;
+            const auto has_qp = [&](const string& name) { return qparams.count(name) > 0; };
+
+            string type;
+            if (plain && nchw && (op.type() == "Conv" || op.type() == "ConvRelu") && (op.input_size() == 2 || op.input_size() == 3)
+                && has_qp(op.input(0)) && has_qp(op.output(0)))
+            {
+                const auto w = const_float(op.input(1));
+                const auto b = op.input_size() == 3 ? const_float(op.input(2)) : nullptr;
+                if (w && w->dim() == 4 && (op.input_size() == 2 || (b && b->numel() == w->size(0))))
+                {
+                    const auto x = int8_input(op.input(0), true);
+                    const auto wq = quantize_weight(op.input(1), *w, true);
+                    const auto bq = quantize_bias(op.input_size() == 3 ? op.input(2) : op.input(1) + "_b", b, w->size(0), x.qp.scale * wq.second.scale);
+                    const auto y = int8_output(op.output(0), true, qparams.at(op.output(0)));
+                    auto& q_op = add_op(op.type() == "Conv" ? "Int8Conv" : "Int8ConvRelu", { x.name, wq.first, bq }, { y.name });
+                    copy_args(op, q_op, y.qp, true);
+                    type = q_op.type();
+                }
+            }
+            else if (plain && op.type() == "FC" && op.input_size() == 3 && !get_arg(op, "axis") && !get_arg(op, "axis_w")
+                && has_qp(op.input(0)) && has_qp(op.output(0)))
+            {
+                const auto w = const_float(op.input(1));
+                const auto b = const_float(op.input(2));
+                if (w && w->dim() == 2 && b && b->numel() == w->size(0))
+                {
+                    const auto x = int8_input(op.input(0), false);
+                    const auto wq = quantize_weight(op.input(1), *w, false);
+                    const auto bq = quantize_bias(op.input(2), b, w->size(0), x.qp.scale * wq.second.scale);
+                    const auto y = int8_output(op.output(0), false, qparams.at(op.output(0)));
+                    auto& q_op = add_op("Int8FC", { x.name, wq.first, bq }, { y.name });
+                    copy_args(op, q_op, y.qp, false);
+                    type = q_op.type();
+                }
+            }
+            else if (plain && op.input_size() == 1 && int8.count(op.input(0))
+                && (op.type() == "Relu" || (nchw && int8.at(op.input(0)).nhwc && op.type() == "MaxPool")))
+            {
+                // Output shares quantization of input.
+                const auto x = int8.at(op.input(0));
+                const auto y = int8_output(op.output(0), x.nhwc, x.qp);
+                auto& q_op = add_op("Int8" + op.type(), { x.name }, { y.name });
+                copy_args(op, q_op, y.qp, x.nhwc);
+                type = q_op.type();
+            }
+            else if (plain && nchw && op.type() == "AveragePool" && op.input_size() == 1 && int8.count(op.input(0))
+                && int8.at(op.input(0)).nhwc && has_qp(op.output(0)))
+            {
+                const auto x = int8.at(op.input(0));
+                const auto y = int8_output(op.output(0), true, qparams.at(op.output(0)));
+                auto& q_op = add_op("Int8AveragePool", { x.name }, { y.name });
+                copy_args(op, q_op, y.qp, true);
+                type = q_op.type();
+            }
+            else if (plain && (op.type() == "Sum" || (op.type() == "Add" && !get_arg(op, "broadcast"))) && op.input_size() == 2
+                && int8.count(op.input(0)) && int8.count(op.input(1)) && has_qp(op.output(0))
+                && int8.at(op.input(0)).nhwc == int8.at(op.input(1)).nhwc)
+            {
+                const auto a = int8.at(op.input(0));
+                const auto b = int8.at(op.input(1));
+                const auto y = int8_output(op.output(0), a.nhwc, qparams.at(op.output(0)));
+                auto& q_op = add_op("Int8Add", { a.name, b.name }, { y.name });
+                copy_args(op, q_op, y.qp, false);
+                type = q_op.type();
+            }
+
+            if (type.size())
+            {
+                ++quantized;
+                continue;
+            }
+
+            for (const auto& input : op.input())
+                float_input(input);
+            *ops.Add() = op;
+            for (const auto& output : op.output())
+            {
+                int8.erase(output);
+                stale.erase(output);
+            }
+        }
+
+        if (!quantized)
+        {
+            return false;
+        }
+
+        for (const auto& name : pred_net.external_output())
+            float_input(name);
+
+        pred_net.mutable_op()->Swap(&ops);
+
+        LOG(INFO) << "Quantized " << quantized << " ops into int8.";
+        return true;
+    }
+}
@@ -0,0 +1,109 @@
+#include "siphon/affinity.h"
+#include "siphon/core.h"
+
+#include <caffe2/core/logging.h>
+#include <caffe2/core/tensor_int8.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace caffe2;
+
+namespace siphon
+{
+    SIPHON_API
+    vector<int> Siphon::replicate()
+    {
+        map<int, vector<int>> nodes;
+        for (auto& node : numa_nodes())
+        {
+            auto& cpus = node.second;
+            if (cpu_set.size())
+            {
+                cpus.erase(remove_if(cpus.begin(), cpus.end(), [&](int cpu)
+                    {
+                        return find(cpu_set.begin(), cpu_set.end(), cpu) == cpu_set.end();
+                    }), cpus.end());
+            }
+            if (cpus.size())
+            {
+                nodes.emplace(node.first, move(cpus));
+            }
+        }
+
+        if (nodes.size() < 2)
+        {
+            LOG(INFO) << "Single NUMA node in use. Share weights without replica.";
+            return {};
+        }
+
+        // Replicas in use by sessions are kept, so only missing nodes are copied.
+        vector<int> added;
+        vector<future<int64_t>> copies;
+        for (auto& node : nodes)
+        {
+            if (replicas.count(node.first))
+            {
+                continue;
+            }
+            added.emplace_back(node.first);
+
+            const auto replica = &replicas[node.first];
+            replica->cpus = move(node.second);
+            replica->ws = make_unique<Workspace>(&ws);
+
+            /*
+             * Allocate and write on the node itself, so that pages are placed there by first touch.
+             * Local blobs shadow those of the parent, since CreateBlob() would return the shared ones.
+             */
+            copies.emplace_back(async(launch::async, [this, replica]()
+                {
+                    pin_thread(replica->cpus);
+
+                    int64_t bytes = 0;
+                    for (const auto& name : ws.Blobs())
+                    {
+                        const auto src = ws.GetBlob(name);
+                        if (BlobIsTensorType(*src, dev_type))
+                        {
+                            const auto& tensor = src->Get<Tensor>();
+                            BlobGetMutableTensor(replica->ws->CreateLocalBlob(name), dev_type)->CopyFrom(tensor);
+                            bytes += tensor.nbytes();
+                        }
+                        else if (src->IsType<int8::Int8TensorCPU>())
+                        {
+                            const auto& tensor = src->Get<int8::Int8TensorCPU>();
+                            auto& dst = *replica->ws->CreateLocalBlob(name)->GetMutable<int8::Int8TensorCPU>();
+                            dst.scale = tensor.scale;
+                            dst.zero_point = tensor.zero_point;
+                            dst.t.CopyFrom(tensor.t);
+                            bytes += tensor.t.nbytes();
+                        }
+                        else
+                        {
+                            continue;
+                        }
+                        CAFFE_ENFORCE(replica->ws->GetBlob(name) != src, "Replica of weight \"" + name + "\" aliases the shared one.");
+                    }
+                    return bytes;
+                }));
+        }
+
+        for (size_t i = 0; i < added.size(); ++i)
+        {
+            const auto bytes = copies[i].get();
+            LOG(INFO) << "Replicate " << bytes << " bytes of weights on NUMA node " << added[i] << " with " << replicas.at(added[i]).cpus.size() << " CPUs.";
+        }
+
+        vector<int> ret;
+        for (const auto& node : nodes)
+            ret.emplace_back(node.first);
+        return ret;
+    }
+}
@@ -1,27 +1,40 @@
 #include "siphon/core.h"
 
 #include <caffe2/core/logging.h>
+#include <caffe2/onnx/backend.h>
+#include <caffe2/onnx/onnx_exporter.h>
 #include <caffe2/utils/proto_utils.h>
 
+#include <onnx/checker.h>
 #include <onnx/onnx_pb.h>
+#include <onnx/shape_inference/implementation.h>
 
-#include <pybind11/embed.h>
+#ifdef SIPHON_USE_PYTHON
+    #include <pybind11/embed.h>
+#endif
 
+#include <algorithm>
+#include <exception>
 #include <filesystem>
 #include <locale>
+#include <map>
+#include <set>
 #include <string>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace std;
 using namespace std::filesystem;
 using namespace caffe2;
-using namespace pybind11::literals;
 
 using ::ONNX_NAMESPACE::ModelProto;
 
 namespace siphon
 {
+#ifdef SIPHON_USE_PYTHON
     namespace py = pybind11;
+#endif
 
     SIPHON_API
     void Siphon::save_onnx(path dir)
@@ -35,81 +48,228 @@ namespace siphon
         CAFFE_ENFORCE(nets.count("pred"), "Predict net doesn't exist.");
         CAFFE_ENFORCE(value_info.size(), "Missing value info.");
 
-        LOG(INFO) << "Convert fill ops into GivenTensor*Fill ops for init net.";
-        eval_fill(nets["init"]);
+        const auto key = fingerprint("onnx");
+        if (restore_cache(key, dir))
+        {
+            LOG(INFO) << "Model saved in ONNX format from cache successfully.";
+            return;
+        }
 
         LOG(INFO) << "Convert fill ops into GivenTensor*Fill ops for predict net.";
         eval_fill(nets["pred"]);
 
         save_value_info(dir / "value_info.json");
 
-        string init_str;
-        string pred_str;
-        nets["init"].SerializeToString(&init_str);
-        nets["pred"].SerializeToString(&pred_str);
-
-        LOG(INFO) << "Found suitable network for ONNX. Send to python for processing.";
-
-        string onnx_model_str;
         ModelProto onnx_model;
 
         LOG(INFO) << "Save to ONNX using value info:\n" << show_value_info("\t");
 
-        // Python inter-ops.
-        pyenv.exec([&]()
-            {
-                py::dict value_info_py;
-                for (const auto& info : value_info)
+        if (export_onnx(onnx_model))
+        {
+            LOG(INFO) << "Convert Caffe2 model to ONNX in C++ successfully.";
+        }
+        else
+        {
+#ifdef SIPHON_USE_PYTHON
+            onnx_model.Clear();
+
+            LOG(INFO) << "Convert fill ops into GivenTensor*Fill ops for init net.";
+            eval_fill(nets["init"]);
+
+            string init_str;
+            string pred_str;
+            nets["init"].SerializeToString(&init_str);
+            nets["pred"].SerializeToString(&pred_str);
+
+            LOG(INFO) << "Fall back to python for ONNX model conversion.";
+
+            // Python inter-ops.
+            pyenv.exec([&]()
                 {
-                    CHECK_GT(info.second.dims.size(), static_cast<size_t>(0)) << "Missing dimension info.";
-                    py::tuple dims_py(info.second.dims.size());
-                    for (size_t i = 0; i < info.second.dims.size(); ++i)
+                    py::dict value_info_py;
+                    for (const auto& info : value_info)
                     {
-                        dims_py[i] = info.second.dims[i];
+                        CHECK_GT(info.second.dims.size(), static_cast<size_t>(0)) << "Missing dimension info.";
+                        py::tuple dims_py(info.second.dims.size());
+                        for (size_t i = 0; i < info.second.dims.size(); ++i)
+                        {
+                            dims_py[i] = info.second.dims[i];
+                        }
+                        value_info_py[info.first.c_str()] = make_tuple(static_cast<int>(info.second.type), dims_py);
                     }
-                    value_info_py[info.first.c_str()] = make_tuple(static_cast<int>(info.second.type), dims_py);
+
+                    auto proto_module = pyenv.import("caffe2.proto.caffe2_pb2");
+                    auto frontend_module = pyenv.import("caffe2.python.onnx.frontend");
+
+                    LOG(INFO) << "Deserialize init network in python.";
+                    auto init = proto_module.attr("NetDef")();
+                    init.attr("ParseFromString")(PyEnv::view(init_str));
+
+                    LOG(INFO) << "Deserialize predict network in python.";
+                    auto pred = proto_module.attr("NetDef")();
+                    pred.attr("ParseFromString")(PyEnv::view(pred_str));
+
+                    LOG(INFO) << "Create ONNX model in python.";
+                    auto onnx_model_py = PyEnv::call(frontend_module.attr("caffe2_net_to_onnx_model"), pred, init, value_info_py);
+
+                    LOG(INFO) << "Serialize ONNX model and deserialize in C++.";
+                    PyEnv::parse(onnx_model_py.attr("SerializeToString")(), onnx_model);
+                });
+#else
+            CAFFE_THROW("Failed to convert Caffe2 model to ONNX in C++, and Python fallback is not built.");
+#endif
+
+            LOG(INFO) << "Check ONNX model in C++.";
+            ::ONNX_NAMESPACE::checker::check_model(onnx_model);
+        }
+
+        LOG(INFO) << "Passed sanity check for ONNX model.";
+
+        WriteProtoToBinaryFile(onnx_model, (dir / "model.onnx").string());
+
+        store_cache(key, dir);
+
+        LOG(INFO) << "Model saved in ONNX format successfully.";
+    }
+
+    SIPHON_HIDDEN
+    bool Siphon::export_onnx(ModelProto& onnx_model)
+    {
+        // Weights are read from workspace, so init ops are dropped. SSA rewrite only accepts GivenTensor*Fill ops in init net.
+        auto init_net = nets["init"];
+        init_net.clear_op();
+        auto pred_net = nets["pred"];
+
+        const auto set_type = [](::ONNX_NAMESPACE::ValueInfoProto& vi, ::ONNX_NAMESPACE::TensorProto_DataType type, const auto& dims, const vector<string>& symbols = {})
+            {
+                auto& tensor_type = *vi.mutable_type()->mutable_tensor_type();
+                tensor_type.set_elem_type(type);
+                auto& shape = *tensor_type.mutable_shape();
+                for (size_t i = 0; i < static_cast<size_t>(dims.size()); ++i)
+                {
+                    if (i < symbols.size() && symbols[i].size())
+                        shape.add_dim()->set_dim_param(symbols[i]);
+                    else
+                        shape.add_dim()->set_dim_value(dims[i]);
                 }
+            };
 
-                auto onnx_module = pyenv.import("onnx");
-                auto proto_module = pyenv.import("caffe2.proto.caffe2_pb2");
-                auto frontend_module = pyenv.import("caffe2.python.onnx.frontend");
+        try
+        {
+            LOG(INFO) << "Rewrite Caffe2 nets in SSA form.";
+            map<string, string> origins;
+            for (auto& renamed : caffe2::onnx::SsaRewrite(&init_net, &pred_net))
+            {
+                origins.emplace(move(renamed));
+            }
+            const auto origin = [&](const string& name)
+                {
+                    const auto iter = origins.find(name);
+                    return iter == origins.end() ? name : iter->second;
+                };
 
-                LOG(INFO) << "Deserialize init network in python.";
-                auto init = proto_module.attr("NetDef")();
-                init.attr("ParseFromString")(py::bytes(init_str));
+            unordered_map<string, TensorShape> shapes;
+            for (auto& shape : infer_shapes(pred_net, origins))
+            {
+                shapes.emplace(shape.first, move(shape.second));
+            }
 
-                LOG(INFO) << "Deserialize predict network in python.";
-                auto pred = proto_module.attr("NetDef")();
-                pred.attr("ParseFromString")(py::bytes(pred_str));
+            onnx_model.set_ir_version(::ONNX_NAMESPACE::IR_VERSION);
+            onnx_model.set_producer_name("siphon");
+            {
+                auto& opset = *onnx_model.add_opset_import();
+                opset.set_domain("");
+                opset.set_version(onnx_opset_version);
+            }
 
-                LOG(INFO) << "Create ONNX model in python.";
-                auto caffe2_net_to_onnx_model = frontend_module.attr("caffe2_net_to_onnx_model");
-                auto onnx_model_py = caffe2_net_to_onnx_model(pred, init, value_info_py);
+            auto& graph = *onnx_model.mutable_graph();
+            graph.set_name(pred_net.name());
 
-                LOG(INFO) << "Serialize ONNX model and send back to C++.";
+            LOG(INFO) << "Convert " << pred_net.op_size() << " Caffe2 ops to ONNX nodes.";
+            caffe2::onnx::OnnxExporter exporter;
+            for (const auto& op : pred_net.op())
+            {
+                auto res = exporter.Caffe2OpToOnnxNodes(op, shapes);
+                for (auto& node : res.first)
                 {
-                    py::bytes onnx_model_str_py = onnx_model_py.attr("SerializeToString")();
-                    onnx_model_str = static_cast<string>(onnx_model_str_py);
+                    *graph.add_node() = move(node);
                 }
+                for (auto& tensor : res.second)
+                {
+                    *graph.add_initializer() = move(tensor);
+                }
+            }
 
-                LOG(INFO) << "Deserialize ONNX model in C++..";
-                ParseProtoFromLargeString(static_cast<string>(onnx_model_str), &onnx_model);
-                onnx_model.SerializeToString(&onnx_model_str);
+            // Restore names of external inputs renamed by SSA rewrite, so that graph inputs match value info and weights.
+            {
+                set<string> produced;
+                for (const auto& node : graph.node())
+                    produced.insert(node.output().begin(), node.output().end());
+                for (const auto& renamed : origins)
+                    CAFFE_ENFORCE(!produced.count(renamed.second), "Input \"" + renamed.second + "\" is overwritten in predict net.");
+                for (auto& node : *graph.mutable_node())
+                    for (auto& name : *node.mutable_input())
+                        name = origin(name);
+            }
+
+            LOG(INFO) << "Copy weights to ONNX initializers as raw data.";
+            for (const auto& ssa_name : pred_net.external_input())
+            {
+                const auto name = origin(ssa_name);
+                auto& input = *graph.add_input();
+                input.set_name(name);
 
-                LOG(INFO) << "Send ONNX model back to python for check.";
-                auto model_proto_py = onnx_module.attr("ModelProto")();
-                model_proto_py.attr("ParseFromString")(py::bytes(onnx_model_str));
+                if (value_info.count(name))
+                {
+                    const auto& info = value_info.at(name);
+                    set_type(input, info.type, info.dims, info.symbols);
+                    continue;
+                }
 
-                LOG(INFO) << "Check ONNX model in python.";
-                auto check_model = onnx_module.attr("checker").attr("check_model");
-                check_model(py::bytes(model_proto_py));
-            });
+                const auto blob = ws.GetBlob(name);
+                CAFFE_ENFORCE(blob && BlobIsTensorType(*blob, dev_type), "Weight \"" + name + "\" is not a tensor in workspace.");
+                const auto& tensor = blob->Get<Tensor>();
+                const auto type = onnx_type(TypeMetaToDataType(tensor.dtype()));
+                CAFFE_ENFORCE(type != ::ONNX_NAMESPACE::TensorProto_DataType_STRING, "Weight \"" + name + "\" of string type cannot be stored as raw data.");
 
-        LOG(INFO) << "Passed sanity check for ONNX model.";
+                auto& initializer = *graph.add_initializer();
+                initializer.set_name(name);
+                initializer.set_data_type(type);
+                for (const auto dim : tensor.sizes())
+                {
+                    initializer.add_dims(dim);
+                }
+                initializer.set_raw_data(tensor.raw_data(), tensor.nbytes());
 
-        WriteProtoToBinaryFile(onnx_model, (dir / "model.onnx").string());
+                set_type(input, type, tensor.sizes());
+            }
 
-        LOG(INFO) << "Model saved in ONNX format successfully.";
+            for (const auto& ssa_name : pred_net.external_output())
+            {
+                const auto name = origin(ssa_name);
+                auto& output = *graph.add_output();
+                output.set_name(name);
+
+                const auto iter = shapes.find(ssa_name);
+                if (iter == shapes.end())
+                {
+                    LOG(WARNING) << "Unknown shape of output \"" << name << "\". Assume float.";
+                    output.mutable_type()->mutable_tensor_type()->set_elem_type(::ONNX_NAMESPACE::TensorProto_DataType_FLOAT);
+                    continue;
+                }
+                set_type(output, onnx_type(iter->second.data_type()), iter->second.dims());
+            }
+
+            LOG(INFO) << "Check ONNX model in C++.";
+            ::ONNX_NAMESPACE::checker::check_model(onnx_model);
+        }
+        catch (const exception& e)
+        {
+            LOG(WARNING) << "Failed to convert Caffe2 model to ONNX in C++:\n" << e.what();
+            return false;
+        }
+
+        return true;
     }
 
     SIPHON_HIDDEN
@@ -119,58 +279,191 @@ namespace siphon
 
         LOG(INFO) << "Load ONNX model " << fn << ".";
 
-        // Parse ONNX model in C++ first for better debugging experience.
-
         ModelProto onnx_model;
         CAFFE_ENFORCE(ReadProtoFromFile(fn.string(), &onnx_model), "Failed to read ONNX model \"" + fn.string() + "\".");
 
-        string onnx_model_str;
-        onnx_model.SerializeToString(&onnx_model_str);
+        NetDef init_net;
+        NetDef pred_net;
+
+        if (import_onnx(onnx_model, init_net, pred_net))
+        {
+            LOG(INFO) << "Convert ONNX model to Caffe2 format in C++ successfully.";
+        }
+        else
+        {
+#ifdef SIPHON_USE_PYTHON
+            init_net = NetDef();
+            pred_net = NetDef();
+
+            string onnx_model_str;
+            onnx_model.SerializeToString(&onnx_model_str);
+
+            LOG(INFO) << "Fall back to python for ONNX model conversion.";
+
+            // Python inter-ops.
+            pyenv.exec([&]()
+                {
+                    auto onnx_module = pyenv.import("onnx");
+                    auto proto_module = pyenv.import("caffe2.proto.caffe2_pb2");
+                    auto backend_module = pyenv.import("caffe2.python.onnx.backend");
+
+                    LOG(INFO) << "Deserialize ONNX model in python.";
+                    auto model_proto_py = onnx_module.attr("ModelProto")();
+                    model_proto_py.attr("ParseFromString")(PyEnv::view(onnx_model_str));
+
+                    LOG(INFO) << "Convert ONNX model to Caffe2 format in python.";
+
+                    auto onnx_graph_to_caffe2_net = backend_module.attr("Caffe2Backend").attr("onnx_graph_to_caffe2_net");
+                    auto c2_nets_py = py::tuple(PyEnv::call(onnx_graph_to_caffe2_net, model_proto_py, DeviceTypeName(dev_type), 8));
+
+                    LOG(INFO) << "Serialize Caffe2 model in python and deserialize in C++.";
+                    PyEnv::parse(c2_nets_py[0].attr("SerializeToString")(), init_net);
+                    PyEnv::parse(c2_nets_py[1].attr("SerializeToString")(), pred_net);
+                });
+#else
+            CAFFE_THROW("Failed to convert ONNX model to Caffe2 format in C++, and Python fallback is not built.");
+#endif
+        }
 
-        LOG(INFO) << "Parse ONNX model in C++ successfully. Send to python for processing.";
+        init_net.set_name("init");
+        nets[init_net.name()] = move(init_net);
 
-        string init_str;
-        string pred_str;
+        pred_net.set_name("pred");
+        nets[pred_net.name()] = move(pred_net);
 
-        // Python inter-ops.
-        pyenv.exec([&]()
+        LOG(INFO) << "ONNX model loaded successfully.";
+    }
+
+    SIPHON_HIDDEN
+    bool Siphon::import_onnx(ModelProto& onnx_model, NetDef& init_net, NetDef& pred_net)
+    {
+        // Converters only implemented in caffe2.python.onnx.backend.
+        static const set<string> python_only{ "GRU", "If", "LSTM", "Loop", "RNN" };
+
+        const auto& graph = onnx_model.graph();
+
+        for (const auto& node : graph.node())
+        {
+            if (python_only.count(node.op_type()) || (node.domain().size() && node.domain() != "ai.onnx"))
+            {
+                LOG(INFO) << "ONNX op \"" << node.op_type() << "\" is not supported in C++.";
+                return false;
+            }
+        }
+
+        int opset_version = 0;
+        for (const auto& opset : onnx_model.opset_import())
+        {
+            if (opset.domain().empty() || opset.domain() == "ai.onnx")
             {
-                auto onnx_module = pyenv.import("onnx");
-                auto proto_module = pyenv.import("caffe2.proto.caffe2_pb2");
-                auto backend_module = pyenv.import("caffe2.python.onnx.backend");
+                opset_version = static_cast<int>(opset.version());
+            }
+        }
+        CAFFE_ENFORCE_GT(opset_version, 0, "Missing default opset in ONNX model.");
 
-                LOG(INFO) << "Deserialize ONNX model in python.";
-                auto model_proto_py = onnx_module.attr("ModelProto")();
-                model_proto_py.attr("ParseFromString")(py::bytes(onnx_model_str));
+        LOG(INFO) << "Infer shapes of ONNX model with opset " << opset_version << ".";
+        ::ONNX_NAMESPACE::shape_inference::InferShapes(onnx_model);
 
-                LOG(INFO) << "Convert ONNX model to Caffe2 format in python.";
+        caffe2::onnx::ValueInfoMap value_infos;
+        unordered_set<string> used_names;
+        for (const auto* vis : { &graph.input(), &graph.value_info(), &graph.output() })
+        {
+            for (const auto& vi : *vis)
+            {
+                value_infos[vi.name()] = vi;
+                used_names.emplace(vi.name());
+            }
+        }
+        for (const auto& tensor : graph.initializer())
+        {
+            used_names.emplace(tensor.name());
+        }
+        for (const auto& node : graph.node())
+        {
+            used_names.insert(node.input().begin(), node.input().end());
+            used_names.insert(node.output().begin(), node.output().end());
+        }
 
-                auto backend = backend_module.attr("Caffe2Backend")();
-                auto onnx_graph_to_caffe2_net = backend.attr("onnx_graph_to_caffe2_net");
-                auto c2_nets_py = py::tuple(onnx_graph_to_caffe2_net(model_proto_py, DeviceTypeName(dev_type), 8));
+        caffe2::onnx::DummyName dummy;
+        dummy.Reset(used_names);
+        caffe2::onnx::Caffe2Backend backend(&dummy);
+        const caffe2::onnx::ConversionContext ctx(value_infos, opset_version);
 
-                LOG(INFO) << "Serialize Caffe2 model in python and send back to C++.";
+        for (auto net : { &init_net, &pred_net })
+        {
+            net->mutable_device_option()->set_device_type(static_cast<int>(dev_type));
+        }
 
-                init_str = static_cast<string>(py::bytes(c2_nets_py[0].attr("SerializeToString")()));
-                pred_str = static_cast<string>(py::bytes(c2_nets_py[1].attr("SerializeToString")()));
-            });
+        LOG(INFO) << "Convert " << graph.initializer_size() << " ONNX initializers to Caffe2 init net.";
+        for (const auto& tensor : graph.initializer())
+        {
+            backend.BuildTensorFillingOp(init_net.add_op(), tensor);
+            init_net.add_external_output(tensor.name());
+        }
 
-        LOG(INFO) << "Deserialize and initialize Caffe2 init net in C++.";
+        LOG(INFO) << "Convert " << graph.node_size() << " ONNX nodes to Caffe2 predict net.";
+        for (const auto& node : graph.node())
         {
-            NetDef net;
-            ParseProtoFromLargeString(init_str, &net);
-            net.set_name("init");
-            nets[net.name()] = move(net);
+            try
+            {
+                auto c2_ops = backend.ConvertNode(node.SerializeAsString(), ctx);
+                init_net.mutable_op()->MergeFrom(c2_ops.init_ops);
+                pred_net.mutable_op()->MergeFrom(c2_ops.ops);
+                for (const auto& blob_name : c2_ops.interface_blobs)
+                {
+                    pred_net.add_external_input(blob_name);
+                }
+            }
+            catch (const exception& e)
+            {
+                LOG(WARNING) << "Failed to convert ONNX op \"" << node.op_type() << "\" in C++:\n" << e.what();
+                return false;
+            }
         }
 
-        LOG(INFO) << "Deserialize and initialize Caffe2 predict net in C++.";
+        for (const auto& vi : graph.input())
+        {
+            pred_net.add_external_input(vi.name());
+        }
+        for (const auto& vi : graph.output())
         {
-            NetDef net;
-            ParseProtoFromLargeString(pred_str, &net);
-            net.set_name("pred");
-            nets[net.name()] = move(net);
+            pred_net.add_external_output(vi.name());
         }
 
-        LOG(INFO) << "ONNX model loaded successfully.";
+        set<string> initializers;
+        for (const auto& tensor : graph.initializer())
+        {
+            initializers.emplace(tensor.name());
+        }
+        for (const auto& vi : graph.input())
+        {
+            if (value_info.count(vi.name()) || initializers.count(vi.name()) || !vi.type().has_tensor_type())
+            {
+                continue;
+            }
+
+            const auto& tensor_type = vi.type().tensor_type();
+            ValueInfo info;
+            info.type = static_cast<::ONNX_NAMESPACE::TensorProto_DataType>(tensor_type.elem_type());
+            auto symbolic = false;
+            for (const auto& dim : tensor_type.shape().dim())
+            {
+                // Symbolic dims default to 1, as in value info files.
+                info.dims.emplace_back(dim.has_dim_value() ? static_cast<int>(dim.dim_value()) : dim.has_dim_param() ? 1 : 0);
+                info.symbols.emplace_back(dim.has_dim_param() ? dim.dim_param() : "");
+                symbolic = symbolic || dim.has_dim_param();
+            }
+            if (!symbolic)
+            {
+                info.symbols.clear();
+            }
+            if (info.dims.size() && find(info.dims.begin(), info.dims.end(), 0) == info.dims.end())
+            {
+                LOG(INFO) << "Use value info of input \"" << vi.name() << "\" from ONNX model.";
+                value_info[vi.name()] = move(info);
+            }
+        }
+
+        return true;
     }
 }
@@ -0,0 +1,571 @@
+#include "siphon/core.h"
+
+#include <caffe2/core/logging.h>
+#include <caffe2/core/operator.h>
+#include <caffe2/core/types.h>
+#include <caffe2/utils/proto_utils.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace caffe2;
+
+using google::protobuf::RepeatedPtrField;
+
+namespace siphon
+{
+    SIPHON_HIDDEN
+    bool Siphon::fuse_ops(NetDef& init_net, NetDef& pred_net)
+    {
+        map<string, int> writes;
+        map<string, int> reads;
+        const auto count = [&](const OperatorDef& op, int delta)
+            {
+                for (const auto& input : op.input())
+                    reads[input] += delta;
+                for (const auto& output : op.output())
+                    writes[output] += delta;
+            };
+        for (const auto& op : pred_net.op())
+            count(op, 1);
+        for (const auto& name : pred_net.external_output())
+            ++reads[name];
+
+        set<string> consts;
+        for (const auto& name : init_net.external_output())
+            if (!writes.count(name) && !value_info.count(name) && ws.HasBlob(name))
+                consts.emplace(name);
+
+        const auto const_float = [&](const string& name) -> const Tensor*
+            {
+                if (!consts.count(name))
+                    return nullptr;
+                const auto blob = ws.GetBlob(name);
+                if (!blob || !BlobIsTensorType(*blob, dev_type))
+                    return nullptr;
+                const auto& tensor = BlobGetTensor(*blob, dev_type);
+                return tensor.IsType<float>() ? &tensor : nullptr;
+            };
+
+        const auto get_arg = [](const OperatorDef& op, const string& name) -> const Argument*
+            {
+                for (const auto& arg : op.arg())
+                    if (arg.name() == name)
+                        return &arg;
+                return nullptr;
+            };
+
+        const auto order = [&](const OperatorDef& op)
+            {
+                const auto arg = get_arg(op, "order");
+                return arg ? arg->s() : string("NCHW");
+            };
+
+        vector<bool> removed(pred_net.op_size());
+
+        /*
+         * Only the next remaining op can consume a fused output, to keep the rewrite local.
+         * If it overwrites the output in place, later reads are fine, since they only observe its result.
+         */
+        const auto sole_consumer = [&](int op_idx)
+            {
+                const auto& op = pred_net.op(op_idx);
+                auto next = op_idx + 1;
+                while (next < pred_net.op_size() && removed[next])
+                    ++next;
+                if (next >= pred_net.op_size() || op.output_size() != 1)
+                    return -1;
+                const auto& consumer = pred_net.op(next);
+                const auto& output = op.output(0);
+                const auto in_place = consumer.output_size() == 1 && consumer.output(0) == output;
+                if (writes[output] != 1 + in_place || (!in_place && reads[output] != 1) || consumer.input_size() < 1 || consumer.input(0) != output)
+                    return -1;
+                if (count_if(consumer.input().begin(), consumer.input().end(), [&](const string& input) { return input == output; }) != 1)
+                    return -1;
+                return next;
+            };
+
+        const auto new_weight = [&](const string& base, const vector<int64_t>& dims)
+            {
+                auto name = base + "_fused";
+                while (ws.HasBlob(name) || writes.count(name))
+                    name += "_";
+                auto& tensor = *BlobGetMutableTensor(ws.CreateBlob(name), dev_type);
+                tensor.Resize(dims);
+                tensor.mutable_data<float>();
+                consts.emplace(name);
+                init_net.add_external_output(name);
+                pred_net.add_external_input(name);
+                return name;
+            };
+
+        int bn_folded = 0;
+        int relu_fused = 0;
+
+        for (int op_idx = 0; op_idx < pred_net.op_size(); ++op_idx)
+        {
+            auto& op = *pred_net.mutable_op(op_idx);
+            if (op.type() != "Conv" || op.engine().size() || op.input_size() < 2 || op.input_size() > 3)
+                continue;
+
+            // Conv + SpatialBN: scale weights per output channel and shift the bias.
+            const auto bn_idx = sole_consumer(op_idx);
+            const auto bn = bn_idx < 0 ? nullptr : pred_net.mutable_op(bn_idx);
+            const auto w = const_float(op.input(1));
+            if (bn && w && bn->type() == "SpatialBN" && bn->input_size() == 5 && bn->output_size() == 1 && order(*bn) == order(op))
+            {
+                const auto b = op.input_size() == 3 ? const_float(op.input(2)) : nullptr;
+                const auto scale = const_float(bn->input(1));
+                const auto shift = const_float(bn->input(2));
+                const auto mean = const_float(bn->input(3));
+                const auto var = const_float(bn->input(4));
+                const auto is_test = get_arg(*bn, "is_test");
+                const auto eps_arg = get_arg(*bn, "epsilon");
+                const auto eps = eps_arg ? eps_arg->f() : 1e-5f;
+                const auto channels = w->dim() ? w->size(0) : 0;
+
+                auto valid = is_test && is_test->i() && (op.input_size() == 2 || b) && scale && shift && mean && var && channels;
+                for (const auto t : { b, scale, shift, mean, var })
+                    valid = valid && (!t || t->numel() == channels);
+
+                if (valid)
+                {
+                    count(op, -1);
+                    count(*bn, -1);
+
+                    const auto w_name = new_weight(op.input(1), w->sizes().vec());
+                    const auto b_name = new_weight(op.input_size() == 3 ? op.input(2) : op.input(1) + "_b", { channels });
+                    auto& w_fused = *BlobGetMutableTensor(ws.GetBlob(w_name), dev_type);
+                    auto& b_fused = *BlobGetMutableTensor(ws.GetBlob(b_name), dev_type);
+
+                    const auto inner = w->numel() / channels;
+                    const auto w_src = w->data<float>();
+                    const auto w_dst = w_fused.mutable_data<float>();
+                    const auto b_dst = b_fused.mutable_data<float>();
+                    for (int64_t c = 0; c < channels; ++c)
+                    {
+                        const auto factor = scale->data<float>()[c] / sqrt(var->data<float>()[c] + eps);
+                        for (int64_t i = 0; i < inner; ++i)
+                            w_dst[c * inner + i] = w_src[c * inner + i] * factor;
+                        const auto bias = b ? b->data<float>()[c] : 0.f;
+                        b_dst[c] = (bias - mean->data<float>()[c]) * factor + shift->data<float>()[c];
+                    }
+                    make_fill(w_name, w_fused, *init_net.mutable_op());
+                    make_fill(b_name, b_fused, *init_net.mutable_op());
+
+                    op.set_input(1, w_name);
+                    if (op.input_size() == 3)
+                        op.set_input(2, b_name);
+                    else
+                        op.add_input(b_name);
+                    *op.mutable_output(0) = bn->output(0);
+                    removed[bn_idx] = true;
+                    count(op, 1);
+                    ++bn_folded;
+                }
+            }
+
+            // Conv + Relu.
+            const auto relu_idx = sole_consumer(op_idx);
+            const auto relu = relu_idx < 0 ? nullptr : &pred_net.op(relu_idx);
+            if (relu && relu->type() == "Relu" && relu->output_size() == 1 && CPUOperatorRegistry()->Has("ConvRelu"))
+            {
+                count(op, -1);
+                count(*relu, -1);
+                op.set_type("ConvRelu");
+                *op.mutable_output(0) = relu->output(0);
+                removed[relu_idx] = true;
+                count(op, 1);
+                ++relu_fused;
+            }
+        }
+
+        if (!bn_folded && !relu_fused)
+        {
+            return false;
+        }
+
+        RepeatedPtrField<OperatorDef> ops;
+        for (int op_idx = 0; op_idx < pred_net.op_size(); ++op_idx)
+            if (!removed[op_idx])
+                *ops.Add() = move(*pred_net.mutable_op(op_idx));
+        pred_net.mutable_op()->Swap(&ops);
+
+        LOG(INFO) << "Fused " << bn_folded << " SpatialBN ops and " << relu_fused << " Relu ops into Conv ops.";
+        return true;
+    }
+
+    SIPHON_HIDDEN
+    bool Siphon::fold_constants(NetDef& init_net, NetDef& pred_net)
+    {
+        // Ops with side effects or random outputs cannot be evaluated ahead of time.
+        static const set<string> unfoldable_types{
+            "Dropout",
+            "GaussianFill",
+            "MSRAFill",
+            "Print",
+            "UniformFill",
+            "UniformIntFill",
+            "XavierFill"
+        };
+
+        map<string, int> writes;
+        for (const auto& op : pred_net.op())
+            for (const auto& output : op.output())
+                ++writes[output];
+
+        // Weights overwritten in predict net are not constant across runs.
+        set<string> consts;
+        for (const auto& name : init_net.external_output())
+            if (!writes.count(name) && !value_info.count(name) && ws.HasBlob(name))
+                consts.emplace(name);
+
+        // Outputs of predict net keep their names, so ops producing them are kept.
+        const set<string> outputs(pred_net.external_output().begin(), pred_net.external_output().end());
+
+        Workspace tmp_ws(&ws);
+        RepeatedPtrField<OperatorDef> ops;
+        set<string> folded;
+
+        for (auto& op : *pred_net.mutable_op())
+        {
+            auto foldable = !unfoldable_types.count(op.type()) && op.output_size();
+            for (const auto& arg : op.arg())
+                foldable = foldable && !arg.has_n() && !arg.nets_size();
+            for (const auto& input : op.input())
+                foldable = foldable && consts.count(input);
+            for (const auto& output : op.output())
+                foldable = foldable && writes[output] == 1 && !value_info.count(output) && !outputs.count(output);
+
+            if (foldable)
+            {
+                try
+                {
+                    foldable = tmp_ws.RunOperatorOnce(op);
+                }
+                catch (const exception& e)
+                {
+                    LOG(WARNING) << "Failed to evaluate " << op.type() << " op ahead of time:\n" << e.what();
+                    foldable = false;
+                }
+                for (const auto& output : op.output())
+                {
+                    const auto blob = tmp_ws.GetBlob(output);
+                    foldable = foldable && blob && BlobIsTensorType(*blob, dev_type);
+                }
+            }
+
+            if (foldable)
+            {
+                LOG(INFO) << "Fold " << op.type() << " op for \"" << op.output(0) << "\".";
+                for (const auto& output : op.output())
+                {
+                    consts.emplace(output);
+                    folded.emplace(output);
+                }
+            }
+            else
+            {
+                *ops.Add() = move(op);
+            }
+        }
+
+        if (folded.empty())
+        {
+            return false;
+        }
+
+        pred_net.mutable_op()->Swap(&ops);
+
+        /*
+         * Folded blobs are shared weights under fresh names, since other levels still compute the original ones,
+         * which would otherwise resolve to the shared blobs in their sessions.
+         */
+        set<string> taken;
+        const auto collect = [&](const NetDef& net)
+            {
+                taken.insert(net.external_input().begin(), net.external_input().end());
+                taken.insert(net.external_output().begin(), net.external_output().end());
+                for (const auto& op : net.op())
+                {
+                    taken.insert(op.input().begin(), op.input().end());
+                    taken.insert(op.output().begin(), op.output().end());
+                }
+            };
+        for (const auto& net : nets)
+            collect(net.second);
+        collect(init_net);
+        collect(pred_net);
+
+        // Only materialize constants still needed by predict net.
+        map<string, string> renames;
+        for (const auto& op : pred_net.op())
+        {
+            for (const auto& input : op.input())
+            {
+                if (!folded.count(input) || renames.count(input))
+                {
+                    continue;
+                }
+
+                auto name = input + "_folded";
+                while (ws.HasBlob(name) || taken.count(name))
+                    name += "_";
+                taken.emplace(name);
+                renames.emplace(input, name);
+
+                const auto& tensor = BlobGetTensor(*tmp_ws.GetBlob(input), dev_type);
+                make_fill(name, tensor, *init_net.mutable_op());
+                init_net.add_external_output(name);
+                pred_net.add_external_input(name);
+                BlobSetTensor(ws.CreateBlob(name), tensor.UnsafeSharedInstance());
+            }
+        }
+
+        for (auto& op : *pred_net.mutable_op())
+        {
+            for (auto& input : *op.mutable_input())
+            {
+                const auto rename = renames.find(input);
+                if (rename != renames.end())
+                    input = rename->second;
+            }
+        }
+
+        return true;
+    }
+
+    SIPHON_HIDDEN
+    void Siphon::prune_init(NetDef& init_net, NetDef& pred_net) const
+    {
+        set<string> needed(pred_net.external_output().begin(), pred_net.external_output().end());
+        for (const auto& op : pred_net.op())
+            needed.insert(op.input().begin(), op.input().end());
+
+        vector<bool> keep(init_net.op_size());
+        for (auto op_idx = init_net.op_size() - 1; op_idx >= 0; --op_idx)
+        {
+            const auto& op = init_net.op(op_idx);
+            for (const auto& output : op.output())
+                keep[op_idx] = keep[op_idx] || needed.count(output);
+            if (keep[op_idx])
+                needed.insert(op.input().begin(), op.input().end());
+        }
+
+        RepeatedPtrField<OperatorDef> ops;
+        for (int op_idx = 0; op_idx < init_net.op_size(); ++op_idx)
+            if (keep[op_idx])
+                *ops.Add() = move(*init_net.mutable_op(op_idx));
+        const auto pruned = init_net.op_size() - ops.size();
+        init_net.mutable_op()->Swap(&ops);
+
+        set<string> removed;
+        RepeatedPtrField<string> outputs;
+        for (auto& name : *init_net.mutable_external_output())
+        {
+            if (needed.count(name))
+                *outputs.Add() = move(name);
+            else
+                removed.emplace(name);
+        }
+        init_net.mutable_external_output()->Swap(&outputs);
+
+        RepeatedPtrField<string> inputs;
+        for (auto& name : *pred_net.mutable_external_input())
+            if (!removed.count(name))
+                *inputs.Add() = move(name);
+        pred_net.mutable_external_input()->Swap(&inputs);
+
+        LOG(INFO) << "Pruned " << pruned << " ops and " << removed.size() << " weights no longer used by predict network.";
+    }
+
+    // Live range of a blob in op order, inclusive on both ends.
+    struct BlobLife
+    {
+        string name;
+        int first = numeric_limits<int>::max();
+        int last = -1;
+        int64_t bytes = 0;
+    };
+
+    struct MemoryPlan
+    {
+        string strategy;
+        map<string, int> assign;
+        vector<int64_t> buffer_bytes;
+        int64_t peak = 0;
+    };
+
+    // Assign each blob to a shared buffer whose previous occupants are all dead.
+    static MemoryPlan color_intervals(string strategy, vector<BlobLife> lives, bool best_fit, bool by_size)
+    {
+        if (by_size)
+            stable_sort(lives.begin(), lives.end(), [](const BlobLife& a, const BlobLife& b) { return a.bytes > b.bytes; });
+        else
+            stable_sort(lives.begin(), lives.end(), [](const BlobLife& a, const BlobLife& b) { return a.first < b.first; });
+
+        MemoryPlan plan;
+        plan.strategy = move(strategy);
+        vector<vector<const BlobLife*>> buffers;
+
+        for (const auto& life : lives)
+        {
+            int chosen = -1;
+            for (int buf_idx = 0; buf_idx < static_cast<int>(buffers.size()); ++buf_idx)
+            {
+                const auto overlap = any_of(buffers[buf_idx].begin(), buffers[buf_idx].end(), [&](const BlobLife* other)
+                    {
+                        return life.first <= other->last && other->first <= life.last;
+                    });
+                if (overlap)
+                    continue;
+                if (chosen < 0)
+                    chosen = buf_idx;
+                if (!best_fit)
+                    break;
+
+                // Prefer the tightest buffer already large enough, otherwise the one growing least.
+                const auto cur = plan.buffer_bytes[chosen];
+                const auto cand = plan.buffer_bytes[buf_idx];
+                const auto cur_fit = cur >= life.bytes;
+                const auto cand_fit = cand >= life.bytes;
+                if ((cand_fit && !cur_fit) || (cand_fit && cur_fit && cand < cur) || (!cand_fit && !cur_fit && cand > cur))
+                    chosen = buf_idx;
+            }
+
+            if (chosen < 0)
+            {
+                chosen = buffers.size();
+                buffers.emplace_back();
+                plan.buffer_bytes.emplace_back(0);
+            }
+            buffers[chosen].emplace_back(&life);
+            plan.buffer_bytes[chosen] = max(plan.buffer_bytes[chosen], life.bytes);
+            plan.assign[life.name] = chosen;
+        }
+
+        for (const auto bytes : plan.buffer_bytes)
+            plan.peak += bytes;
+        return plan;
+    }
+
+    SIPHON_HIDDEN
+    NetDef Siphon::plan_memory(const NetDef& init_net, const NetDef& pred_net, const map<string, vector<int>>& input_dims) const
+    {
+        if (pred_net.has_type() && pred_net.type() != "simple")
+        {
+            LOG(WARNING) << "Memory planning assumes sequential execution. Skip " << pred_net.type() << " net.";
+            return pred_net;
+        }
+        for (const auto& op : pred_net.op())
+            for (const auto& arg : op.arg())
+                if (arg.has_n() || arg.nets_size())
+                {
+                    LOG(WARNING) << "Memory planning doesn't support nets with subnets in " << op.type() << " op. Skip.";
+                    return pred_net;
+                }
+
+        set<string> static_blobs;
+        for (const auto& blob_name : pred_net.external_input())
+            static_blobs.emplace(blob_name);
+        for (const auto& blob_name : pred_net.external_output())
+            static_blobs.emplace(blob_name);
+        for (const auto& blob_name : init_net.external_output())
+            static_blobs.emplace(blob_name);
+
+        map<string, BlobLife> lives;
+        for (int op_idx = 0; op_idx < pred_net.op_size(); ++op_idx)
+        {
+            const auto& op = pred_net.op(op_idx);
+            for (const auto& names : { &op.input(), &op.output() })
+                for (const auto& name : *names)
+                {
+                    if (static_blobs.count(name))
+                        continue;
+                    auto& life = lives[name];
+                    life.name = name;
+                    life.first = min(life.first, op_idx);
+                    life.last = max(life.last, op_idx);
+                }
+        }
+
+        if (lives.empty())
+        {
+            return pred_net;
+        }
+
+        int64_t total = 0;
+        int unknown = 0;
+        {
+            map<string, TensorShape> shapes;
+            try
+            {
+                shapes = peak_shapes(pred_net, input_dims);
+            }
+            catch (const exception& e)
+            {
+                LOG(WARNING) << "Shape inference failed. Memory planning will not be size-aware:\n" << e.what();
+            }
+            for (auto& entry : lives)
+            {
+                if (!shapes.count(entry.first))
+                {
+                    ++unknown;
+                    continue;
+                }
+                entry.second.bytes = nbytes(shapes.at(entry.first));
+                total += entry.second.bytes;
+            }
+        }
+
+        vector<BlobLife> blobs;
+        for (const auto& entry : lives)
+            blobs.emplace_back(entry.second);
+
+        vector<MemoryPlan> plans;
+        plans.emplace_back(color_intervals("greedy", blobs, false, false));
+        plans.emplace_back(color_intervals("best_fit", blobs, true, false));
+        plans.emplace_back(color_intervals("size_desc", blobs, false, true));
+
+        for (const auto& plan : plans)
+            LOG(INFO) << "Memory plan \"" << plan.strategy << "\": "
+                << plan.buffer_bytes.size() << " buffers, peak " << plan.peak << " bytes.";
+        const auto& best = *min_element(plans.begin(), plans.end(), [](const MemoryPlan& a, const MemoryPlan& b)
+            {
+                return a.peak != b.peak ? a.peak < b.peak : a.buffer_bytes.size() < b.buffer_bytes.size();
+            });
+
+        LOG(INFO) << "Use memory plan \"" << best.strategy << "\" for " << lives.size() << " blobs: activations "
+            << total << " bytes -> " << best.peak << " bytes"
+            << (unknown ? " (" + to_string(unknown) + " blobs of unknown size)" : "") << ".";
+
+        if (best.buffer_bytes.size() == lives.size())
+        {
+            return pred_net;
+        }
+
+        const auto rename = [&](const string& name)
+            {
+                return best.assign.count(name) ? "__m" + to_string(best.assign.at(name)) + "_shared" : name;
+            };
+
+        auto pred_opt = pred_net;
+        for (auto& op : *pred_opt.mutable_op())
+        {
+            for (auto& name : *op.mutable_input())
+                name = rename(name);
+            for (auto& name : *op.mutable_output())
+                name = rename(name);
+        }
+        *pred_opt.add_arg() = MakeArgument<int>(memory_planned_arg, 1);
+        return pred_opt;
+    }
+}
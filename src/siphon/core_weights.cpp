@@ -0,0 +1,260 @@
+#include "siphon/core.h"
+
+#include <c10/util/Half.h>
+
+#include <caffe2/core/logging.h>
+#include <caffe2/core/types.h>
+#include <caffe2/utils/proto_utils.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
+using namespace std;
+using namespace std::filesystem;
+using namespace caffe2;
+
+namespace siphon
+{
+    // Round to nearest even, keeping NaN as NaN.
+    static uint16_t float_to_bf16(float value)
+    {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        if (isnan(value))
+            return static_cast<uint16_t>((bits >> 16) | 0x40);
+        bits += 0x7FFF + ((bits >> 16) & 1);
+        return static_cast<uint16_t>(bits >> 16);
+    }
+
+    static float bf16_to_float(uint16_t value)
+    {
+        const auto bits = static_cast<uint32_t>(value) << 16;
+        float ret;
+        memcpy(&ret, &bits, sizeof(ret));
+        return ret;
+    }
+
+    static uint16_t float_to_fp16(float value)
+    {
+        return c10::Half(value).x;
+    }
+
+    static float fp16_to_float(uint16_t value)
+    {
+        return c10::Half(value, c10::Half::from_bits());
+    }
+
+    // Storage encoding of float weights, tagged in the index by save_weights() and expanded on load.
+    static string weight_encoding(const TensorProto& proto)
+    {
+        if (proto.data_type() != TensorProto_DataType_FLOAT || !proto.string_data_size())
+            return "";
+        CAFFE_ENFORCE(proto.string_data_size() == 1 && (proto.string_data(0) == "fp16" || proto.string_data(0) == "bf16"), "Unknown encoding of weight \"" + proto.name() + "\".");
+        return proto.string_data(0);
+    }
+
+    SIPHON_HIDDEN
+    void Siphon::load_weights(path fn)
+    {
+        fn = canonical(fn);
+
+        LOG(INFO) << "Loading weight index from " << fn << ".";
+
+        TensorProtos index;
+        CAFFE_ENFORCE(ReadProtoFromFile(fn.string(), &index), "Failed to read weight index \"" + fn.string() + "\".");
+
+        const auto data_fn = path(fn).replace_extension(".bin");
+        CAFFE_ENFORCE(exists(data_fn), "Weight data file \"" + data_fn.string() + "\" doesn't exist.");
+
+        LOG(INFO) << "Map weight data from " << data_fn << ".";
+        size_t size = 0;
+        {
+            const auto fd = open(data_fn.c_str(), O_RDONLY);
+            CAFFE_ENFORCE(fd >= 0, "Cannot open \"" + data_fn.string() + "\".");
+
+            struct stat st;
+            CAFFE_ENFORCE(!fstat(fd, &st), "Cannot stat \"" + data_fn.string() + "\".");
+            size = static_cast<size_t>(st.st_size);
+
+            // Private mapping keeps the file intact even if a tensor is modified in place.
+            auto addr = size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : nullptr;
+            close(fd);
+            CAFFE_ENFORCE(addr != MAP_FAILED, "Failed to map \"" + data_fn.string() + "\".");
+
+            weights_map = shared_ptr<void>(addr, [size](void* p)
+                {
+                    if (p)
+                        munmap(p, size);
+                });
+        }
+
+        NetDef net;
+        net.set_name("init");
+        int expanded = 0;
+        for (const auto& proto : index.protos())
+        {
+            CAFFE_ENFORCE(proto.has_segment(), "Missing segment of weight \"" + proto.name() + "\".");
+            const auto begin = static_cast<size_t>(proto.segment().begin());
+            const auto end = static_cast<size_t>(proto.segment().end());
+            CAFFE_ENFORCE(begin <= end && end <= size, "Segment of weight \"" + proto.name() + "\" is out of range.");
+
+            auto& tensor = *BlobGetMutableTensor(ws.CreateBlob(proto.name()), dev_type);
+            tensor.Resize(vector<int64_t>(proto.dims().begin(), proto.dims().end()));
+            const auto data = static_cast<char*>(weights_map.get()) + begin;
+            const auto encoding = weight_encoding(proto);
+            if (encoding.size())
+            {
+                CAFFE_ENFORCE_EQ(proto.data_type(), TensorProto_DataType_FLOAT, "Weight \"" + proto.name() + "\" in " + encoding + " is not float.");
+                CAFFE_ENFORCE_EQ(static_cast<size_t>(tensor.numel()) * sizeof(uint16_t), end - begin, "Size mismatch of weight \"" + proto.name() + "\".");
+                const auto src = reinterpret_cast<const uint16_t*>(data);
+                const auto dst = tensor.mutable_data<float>();
+                const auto expand = encoding == "fp16" ? fp16_to_float : bf16_to_float;
+                for (int64_t i = 0; i < tensor.numel(); ++i)
+                    dst[i] = expand(src[i]);
+                ++expanded;
+            }
+            else
+            {
+                const auto dtype = DataTypeToTypeMeta(proto.data_type());
+                CAFFE_ENFORCE_EQ(static_cast<size_t>(tensor.numel()) * dtype.itemsize(), end - begin, "Size mismatch of weight \"" + proto.name() + "\".");
+                tensor.ShareExternalPointer(data, dtype, end - begin);
+            }
+
+            net.add_external_output(proto.name());
+        }
+
+        if (nets.count(net.name()))
+        {
+            LOG(WARNING) << "Overwriting init net. Check if multiple models exist within the same directory.";
+        }
+        nets[net.name()] = move(net);
+
+        LOG(INFO) << "Mapped " << index.protos_size() - expanded << " weights in place and expanded " << expanded
+            << " reduced-precision weights to float (" << size << " bytes).";
+    }
+
+    SIPHON_HIDDEN
+    void Siphon::save_weights(const NetDef& init_net, const path& fn) const
+    {
+        vector<string> names(init_net.external_output().begin(), init_net.external_output().end());
+        if (names.empty())
+        {
+            set<string> visited;
+            for (const auto& op : init_net.op())
+                for (const auto& output : op.output())
+                    if (visited.emplace(output).second)
+                        names.emplace_back(output);
+        }
+
+        const auto data_fn = path(fn).replace_extension(".bin");
+
+        LOG(INFO) << "Save " << names.size() << " weights to " << data_fn << ".";
+
+        CAFFE_ENFORCE(weights_dtype.empty() || weights_dtype == "fp16" || weights_dtype == "bf16", "Unknown weight type \"" + weights_dtype + "\".");
+        const auto compress = weights_dtype == "fp16" ? float_to_fp16 : float_to_bf16;
+        const auto expand = weights_dtype == "fp16" ? fp16_to_float : bf16_to_float;
+
+        // Max absolute error of compressed weights, and its ratio to max absolute value.
+        map<string, pair<float, float>> errors;
+
+        TensorProtos index;
+        {
+            ofstream fout(data_fn, ios::binary);
+            CAFFE_ENFORCE(fout.is_open(), "Failed to open \"" + data_fn.string() + "\".");
+
+            int64_t offset = 0;
+            for (const auto& name : names)
+            {
+                const auto blob = ws.GetBlob(name);
+                CAFFE_ENFORCE(blob && BlobIsTensorType(*blob, dev_type), "Weight \"" + name + "\" is not a tensor in workspace.");
+                const auto& tensor = blob->Get<Tensor>();
+                const auto dtype = TypeMetaToDataType(tensor.dtype());
+                CAFFE_ENFORCE(dtype != TensorProto_DataType_STRING, "Weight \"" + name + "\" of string type cannot be memory-mapped.");
+
+                const auto begin = (offset + weights_alignment - 1) / weights_alignment * weights_alignment;
+                fout << string(begin - offset, '\0');
+
+                /*
+                 * Each weight is indexed by name, type, dims and segment in the data file.
+                 * Float weights compressed to "fp16" or "bf16" are tagged by the encoding as their only string_data,
+                 * which float tensors don't use otherwise.
+                 */
+                auto& proto = *index.add_protos();
+                if (weights_dtype.size() && dtype == TensorProto_DataType_FLOAT)
+                {
+                    const auto src = tensor.data<float>();
+                    vector<uint16_t> buf(tensor.numel());
+                    float max_err = 0;
+                    float max_val = 0;
+                    for (int64_t i = 0; i < tensor.numel(); ++i)
+                    {
+                        buf[i] = compress(src[i]);
+                        max_err = max(max_err, abs(expand(buf[i]) - src[i]));
+                        max_val = max(max_val, abs(src[i]));
+                    }
+                    errors[name] = make_pair(max_err, max_val > 0 ? max_err / max_val : 0.f);
+
+                    fout.write(reinterpret_cast<const char*>(buf.data()), buf.size() * sizeof(uint16_t));
+                    offset = begin + static_cast<int64_t>(buf.size() * sizeof(uint16_t));
+                    proto.add_string_data(weights_dtype);
+                }
+                else
+                {
+                    fout.write(static_cast<const char*>(tensor.raw_data()), tensor.nbytes());
+                    offset = begin + static_cast<int64_t>(tensor.nbytes());
+                }
+                const auto end = offset;
+
+                proto.set_name(name);
+                proto.set_data_type(dtype);
+                for (const auto dim : tensor.sizes())
+                    proto.add_dims(dim);
+                proto.mutable_segment()->set_begin(begin);
+                proto.mutable_segment()->set_end(end);
+            }
+
+            CAFFE_ENFORCE(fout, "Failied to write to \"" + data_fn.string() + "\".");
+        }
+
+        WriteProtoToBinaryFile(index, fn.string());
+
+        if (errors.size())
+        {
+            const auto report_fn = path(fn).replace_extension(".error.json");
+            LOG(INFO) << "Save " << weights_dtype << " compression error of " << errors.size() << " weights to " << report_fn << ".";
+
+            ofstream fout(report_fn);
+            CAFFE_ENFORCE(fout.is_open(), "Failed to open \"" + report_fn.string() + "\".");
+            fout << "{" << endl;
+            fout << "    \"type\": \"" << weights_dtype << "\"," << endl;
+            fout << "    \"weights\": {";
+            float worst = 0;
+            for (auto it = errors.begin(); it != errors.end(); ++it)
+            {
+                fout << (it == errors.begin() ? "" : ",") << endl;
+                fout << "        \"" << it->first << "\": { \"max_abs_err\": " << setprecision(9) << it->second.first
+                    << ", \"max_rel_err\": " << it->second.second << " }";
+                worst = max(worst, it->second.second);
+            }
+            fout << endl << "    }" << endl;
+            fout << "}" << endl;
+            CAFFE_ENFORCE(fout, "Failied to write to \"" + report_fn.string() + "\".");
+
+            LOG(INFO) << "Max relative error of " << weights_dtype << " weights is " << worst << ".";
+        }
+    }
+}
@@ -12,6 +12,20 @@ namespace siphon
     DEFINE_string(load,      "", "Directory to load Caffe2/ONNX network.");
     DEFINE_string(save,      "", "Directory to save in Caffe2 format.");
     DEFINE_string(save_onnx, "", "Directory to save in ONNX format.");
+    DEFINE_string(profile,   "", "File to save per-operator profile of predict nets in Chrome trace format, e.g. trace.json.");
+    DEFINE_string(cache,     "", "Directory to cache converted models by fingerprint of inputs and settings.");
+    DEFINE_string(calib,     "", "Directory of calibration inputs (TensorProtos in *.pb) to quantize predict net into int8.");
+
+    DEFINE_bool(mmap_weights, false, "Save weights as memory-mappable raw data instead of init net.");
+
+    DEFINE_string(weights_dtype, "", "Save float weights as \"fp16\" or \"bf16\" in weight store, which are expanded to float on load.");
+
+    DEFINE_string(net_type, "", "Executor of predict nets, e.g. simple, dag or async_scheduling. Keep net type if empty.");
+    DEFINE_int32(num_workers, 0, "Inter-op worker threads per predict net of non-simple executors. Caffe2 default if not positive.");
+    DEFINE_string(cpu_set, "", "CPUs to pin inference threads to, e.g. 0-7,16-23. No pinning if empty.");
+    DEFINE_int32(intra_op_threads, 0, "Intra-op OpenMP threads per inference thread. Divide cores among inter-op workers if not positive.");
+
+    DEFINE_int32(py_workers, 0, "Number of Python worker processes for ONNX conversion fallbacks. Run in embedded interpreter if 0.");
 
     SIPHON_API
     int Init(const bool force)
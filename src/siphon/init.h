@@ -9,6 +9,16 @@ namespace siphon
     DECLARE_string(load);
     DECLARE_string(save);
     DECLARE_string(save_onnx);
+    DECLARE_string(profile);
+    DECLARE_string(calib);
+    DECLARE_string(cache);
+    DECLARE_bool(mmap_weights);
+    DECLARE_string(weights_dtype);
+    DECLARE_string(net_type);
+    DECLARE_int32(num_workers);
+    DECLARE_string(cpu_set);
+    DECLARE_int32(intra_op_threads);
+    DECLARE_int32(py_workers);
 
     SIPHON_API
     int Init(const bool force = false);
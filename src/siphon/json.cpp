@@ -0,0 +1,382 @@
+#include "siphon/json.h"
+
+#include <caffe2/core/logging.h>
+
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <istream>
+#include <limits>
+#include <string>
+
+using namespace std;
+
+namespace siphon
+{
+    class JsonParser
+    {
+    public:
+        JsonParser(istream& in, const string& source) : in(in), source(source)
+        {
+        }
+
+        Json parse()
+        {
+            auto ret = value(0);
+            skip_ws();
+            if (peek() != EOF)
+                fail("Unexpected trailing content");
+            return ret;
+        }
+
+    private:
+        [[noreturn]] void fail(const string& msg) const
+        {
+            CAFFE_THROW("Syntax error in " + source + ":" + to_string(line) + ":" + to_string(col) + ": " + msg + ".");
+        }
+
+        int peek()
+        {
+            return in.peek();
+        }
+
+        int get()
+        {
+            const auto c = in.get();
+            if (c == '\n')
+            {
+                ++line;
+                col = 1;
+            }
+            else if (c != EOF)
+            {
+                ++col;
+            }
+            return c;
+        }
+
+        void expect(char c)
+        {
+            if (get() != c)
+                fail(string("Expect '") + c + "'");
+        }
+
+        void skip_ws()
+        {
+            for (auto c = peek(); c == ' ' || c == '\t' || c == '\n' || c == '\r'; c = peek())
+                get();
+        }
+
+        Json value(int depth)
+        {
+            if (depth > max_depth)
+                fail("Nested too deep");
+
+            skip_ws();
+            Json ret;
+            switch (peek())
+            {
+            case '{':
+                ret.type = Json::Type::Object;
+                get();
+                skip_ws();
+                if (peek() == '}')
+                {
+                    get();
+                    break;
+                }
+                for (;;)
+                {
+                    skip_ws();
+                    if (peek() != '"')
+                        fail("Expect string key");
+                    auto key = str();
+                    skip_ws();
+                    expect(':');
+                    ret.object.emplace_back(move(key), value(depth + 1));
+                    skip_ws();
+                    const auto c = get();
+                    if (c == '}')
+                        break;
+                    if (c != ',')
+                        fail("Expect ',' or '}'");
+                }
+                break;
+            case '[':
+                ret.type = Json::Type::Array;
+                get();
+                skip_ws();
+                if (peek() == ']')
+                {
+                    get();
+                    break;
+                }
+                for (;;)
+                {
+                    ret.array.emplace_back(value(depth + 1));
+                    skip_ws();
+                    const auto c = get();
+                    if (c == ']')
+                        break;
+                    if (c != ',')
+                        fail("Expect ',' or ']'");
+                }
+                break;
+            case '"':
+                ret.type = Json::Type::String;
+                ret.str = str();
+                break;
+            case 't':
+                literal("true");
+                ret.type = Json::Type::Bool;
+                ret.boolean = true;
+                break;
+            case 'f':
+                literal("false");
+                ret.type = Json::Type::Bool;
+                break;
+            case 'n':
+                literal("null");
+                break;
+            case EOF:
+                fail("Unexpected end of input");
+            default:
+                ret.type = Json::Type::Number;
+                ret.number = number();
+            }
+            return ret;
+        }
+
+        void literal(const char* word)
+        {
+            for (auto p = word; *p; ++p)
+                if (get() != *p)
+                    fail(string("Expect \"") + word + "\"");
+        }
+
+        double number()
+        {
+            string buf;
+            const auto digits = [&]()
+                {
+                    const auto size = buf.size();
+                    while (isdigit(peek()))
+                        buf += static_cast<char>(get());
+                    if (buf.size() == size)
+                        fail("Expect digit");
+                };
+
+            if (peek() == '-')
+                buf += static_cast<char>(get());
+            if (peek() == '0')
+                buf += static_cast<char>(get());
+            else
+                digits();
+            if (peek() == '.')
+            {
+                buf += static_cast<char>(get());
+                digits();
+            }
+            if (peek() == 'e' || peek() == 'E')
+            {
+                buf += static_cast<char>(get());
+                if (peek() == '+' || peek() == '-')
+                    buf += static_cast<char>(get());
+                digits();
+            }
+            return strtod(buf.c_str(), nullptr);
+        }
+
+        uint32_t hex4()
+        {
+            uint32_t ret = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+                const auto c = get();
+                ret <<= 4;
+                if (c >= '0' && c <= '9')
+                    ret |= c - '0';
+                else if (c >= 'a' && c <= 'f')
+                    ret |= c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F')
+                    ret |= c - 'A' + 10;
+                else
+                    fail("Invalid unicode escape");
+            }
+            return ret;
+        }
+
+        static void utf8(string& buf, uint32_t cp)
+        {
+            if (cp < 0x80)
+            {
+                buf += static_cast<char>(cp);
+            }
+            else if (cp < 0x800)
+            {
+                buf += static_cast<char>(0xC0 | (cp >> 6));
+                buf += static_cast<char>(0x80 | (cp & 0x3F));
+            }
+            else if (cp < 0x10000)
+            {
+                buf += static_cast<char>(0xE0 | (cp >> 12));
+                buf += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+                buf += static_cast<char>(0x80 | (cp & 0x3F));
+            }
+            else
+            {
+                buf += static_cast<char>(0xF0 | (cp >> 18));
+                buf += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+                buf += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+                buf += static_cast<char>(0x80 | (cp & 0x3F));
+            }
+        }
+
+        string str()
+        {
+            expect('"');
+            string ret;
+            for (;;)
+            {
+                const auto c = get();
+                if (c == '"')
+                    return ret;
+                if (c == EOF)
+                    fail("Unterminated string");
+                if (static_cast<unsigned char>(c) < 0x20)
+                    fail("Control character in string");
+                if (c != '\\')
+                {
+                    ret += static_cast<char>(c);
+                    continue;
+                }
+
+                switch (const auto e = get())
+                {
+                case '"':
+                case '\\':
+                case '/':
+                    ret += static_cast<char>(e);
+                    break;
+                case 'b':
+                    ret += '\b';
+                    break;
+                case 'f':
+                    ret += '\f';
+                    break;
+                case 'n':
+                    ret += '\n';
+                    break;
+                case 'r':
+                    ret += '\r';
+                    break;
+                case 't':
+                    ret += '\t';
+                    break;
+                case 'u':
+                {
+                    auto cp = hex4();
+                    if (cp >= 0xD800 && cp < 0xDC00)
+                    {
+                        expect('\\');
+                        expect('u');
+                        const auto low = hex4();
+                        if (low < 0xDC00 || low >= 0xE000)
+                            fail("Invalid surrogate pair");
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    utf8(ret, cp);
+                    break;
+                }
+                default:
+                    fail("Invalid escape");
+                }
+            }
+        }
+
+        static const int max_depth = 256;
+
+        istream& in;
+        const string& source;
+        int line = 1;
+        int col = 1;
+    };
+
+    SIPHON_API
+    Json Json::parse(istream& in, const string& source)
+    {
+        return JsonParser(in, source).parse();
+    }
+
+    SIPHON_API
+    const Json* Json::find(const string& key) const
+    {
+        for (const auto& member : object)
+            if (member.first == key)
+                return &member.second;
+        return nullptr;
+    }
+
+    SIPHON_API
+    bool Json::is_int() const
+    {
+        return type == Type::Number && number == floor(number) && number >= numeric_limits<int>::min() && number <= numeric_limits<int>::max();
+    }
+
+    SIPHON_API
+    string Json::type_name(Type type)
+    {
+        switch (type)
+        {
+        case Type::Null:
+            return "null";
+        case Type::Bool:
+            return "bool";
+        case Type::Number:
+            return "number";
+        case Type::String:
+            return "string";
+        case Type::Array:
+            return "array";
+        case Type::Object:
+            return "object";
+        }
+        return "unknown";
+    }
+
+    SIPHON_API
+    string Json::escape(const string& str)
+    {
+        string ret;
+        for (const auto c : str)
+        {
+            switch (c)
+            {
+            case '"':
+                ret += "\\\"";
+                break;
+            case '\\':
+                ret += "\\\\";
+                break;
+            case '\n':
+                ret += "\\n";
+                break;
+            default:
+                // Other control characters are not allowed in JSON strings either.
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    const auto hex = "0123456789abcdef";
+                    ret += "\\u00";
+                    ret += hex[c >> 4];
+                    ret += hex[c & 0xF];
+                }
+                else
+                {
+                    ret += c;
+                }
+            }
+        }
+        return ret;
+    }
+}
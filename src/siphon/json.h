@@ -0,0 +1,68 @@
+#pragma once
+
+#include "siphon/utils.h"
+
+#include <istream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace siphon
+{
+    // JSON value, parsed in a single pass over a stream without backtracking.
+    class Json
+    {
+    public:
+        using istream = std::istream;
+
+        using string = std::string;
+
+        template <typename T>
+        using vector = std::vector<T>;
+
+        enum class Type
+        {
+            Null,
+            Bool,
+            Number,
+            String,
+            Array,
+            Object
+        };
+
+        /*
+         * Parse exactly one JSON value from "in", followed by whitespaces only.
+         * Errors are thrown with line and column in "source".
+         */
+        SIPHON_API
+        static Json parse(istream& in, const string& source = "<json>");
+
+        // Member "key" of object, or nullptr if not found.
+        SIPHON_API
+        const Json* find(const string& key) const;
+
+        // Number with an integral value in range of int, which can be cast safely.
+        SIPHON_API
+        bool is_int() const;
+
+        SIPHON_API
+        static string type_name(Type type);
+
+        // Escape "str" for a JSON string literal, without quotes.
+        SIPHON_API
+        static string escape(const string& str);
+
+        Type type = Type::Null;
+
+        bool boolean = false;
+
+        double number = 0;
+
+        string str;
+
+        vector<Json> array;
+
+        // Members in order of appearance.
+        vector<std::pair<string, Json>> object;
+    };
+}
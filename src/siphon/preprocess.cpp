@@ -0,0 +1,136 @@
+#include "siphon/preprocess.h"
+#include "siphon/core.h"
+
+#include <caffe2/core/logging.h>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace caffe2;
+
+namespace siphon
+{
+    SIPHON_API
+    Preprocessor::Preprocessor(const Siphon& sp, const string& input) : input(input), dev_type(sp.dev_type)
+    {
+        if (this->input.empty())
+        {
+            CAFFE_ENFORCE_EQ(sp.value_info.size(), 1u, "Input name is needed for models with multiple inputs.");
+            this->input = sp.value_info.begin()->first;
+        }
+        CAFFE_ENFORCE(sp.value_info.count(this->input), "Input \"" + this->input + "\" is not found in value info.");
+
+        const auto& info = sp.value_info.at(this->input);
+        CAFFE_ENFORCE(info.type == onnx::TensorProto_DataType_FLOAT, "Input \"" + this->input + "\" is not float.");
+        CAFFE_ENFORCE_EQ(info.dims.size(), 4u, "Input \"" + this->input + "\" is not in NCHW.");
+        channels = info.dims[1];
+        height = info.dims[2];
+        width = info.dims[3];
+        CAFFE_ENFORCE_GT(height, 0, "Input \"" + this->input + "\" has no fixed height.");
+        CAFFE_ENFORCE_GT(width, 0, "Input \"" + this->input + "\" has no fixed width.");
+        CAFFE_ENFORCE(channels == 1 || channels == 3, "Input \"" + this->input + "\" has " + to_string(channels) + " channels instead of 1 or 3.");
+    }
+
+    SIPHON_API
+    void Preprocessor::process(const vector<string>& images, Tensor& tensor) const
+    {
+        CAFFE_ENFORCE_EQ(static_cast<int>(mean.size()), channels, "Size of mean doesn't match channels.");
+        CAFFE_ENFORCE_EQ(static_cast<int>(stddev.size()), channels, "Size of stddev doesn't match channels.");
+
+        tensor.Resize(static_cast<int64_t>(images.size()), channels, height, width);
+        const auto data = tensor.mutable_data<float>();
+        const auto plane = static_cast<size_t>(height) * width;
+
+        // Errors are collected per image, since exceptions cannot leave OpenCV worker threads.
+        vector<string> errors(images.size());
+        cv::parallel_for_(cv::Range(0, static_cast<int>(images.size())), [&](const cv::Range& range)
+            {
+                for (auto i = range.start; i < range.end; ++i)
+                {
+                    try
+                    {
+                        const auto& buf = images[i];
+                        const auto img = buf.empty() ? cv::Mat() : cv::imdecode(cv::Mat(1, static_cast<int>(buf.size()), CV_8U, const_cast<char*>(buf.data())), channels == 1 ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR);
+                        CAFFE_ENFORCE(!img.empty(), "Failed to decode image " + to_string(i) + ".");
+
+                        // Resize so that the shorter side reaches "resize" and the crop fits, then crop at center.
+                        cv::Mat resized;
+                        if (resize > 0)
+                        {
+                            const auto scale = max({ static_cast<double>(resize) / min(img.rows, img.cols), static_cast<double>(height) / img.rows, static_cast<double>(width) / img.cols });
+                            const cv::Size size(max(static_cast<int>(lround(img.cols * scale)), width), max(static_cast<int>(lround(img.rows * scale)), height));
+                            cv::resize(img, resized, size, 0, 0, cv::INTER_LINEAR);
+                        }
+                        else
+                        {
+                            cv::resize(img, resized, cv::Size(width, height), 0, 0, cv::INTER_LINEAR);
+                        }
+                        const auto crop = resized(cv::Rect((resized.cols - width) / 2, (resized.rows - height) / 2, width, height));
+
+                        // Scale, normalize and deinterleave pixels of the crop directly into planes of the tensor.
+                        float scale[3];
+                        float shift[3];
+                        float* dst[3];
+                        int src[3];
+                        for (int c = 0; c < channels; ++c)
+                        {
+                            scale[c] = static_cast<float>(1.0 / (255.0 * stddev[c]));
+                            shift[c] = static_cast<float>(-mean[c] / stddev[c]);
+                            dst[c] = data + (static_cast<size_t>(i) * channels + c) * plane;
+                            src[c] = rgb && channels == 3 ? 2 - c : c;
+                        }
+                        for (int y = 0; y < height; ++y)
+                        {
+                            const auto row = crop.ptr<uint8_t>(y);
+                            for (int x = 0; x < width; ++x)
+                                for (int c = 0; c < channels; ++c)
+                                    dst[c][static_cast<size_t>(y) * width + x] = row[x * channels + src[c]] * scale[c] + shift[c];
+                        }
+                    }
+                    catch (const exception& e)
+                    {
+                        errors[i] = e.what();
+                    }
+                }
+            });
+
+        for (const auto& error : errors)
+            CAFFE_ENFORCE(error.empty(), error);
+    }
+
+    SIPHON_API
+    void Preprocessor::run(Session& sess, const vector<vector<string>>& batches, const function<void(size_t, const map<string, Tensor>&)>& consume) const
+    {
+        if (batches.empty())
+        {
+            return;
+        }
+
+        // Session shares the input buffer, so the next batch goes to the other one.
+        Tensor buffers[2] = { Tensor(dev_type), Tensor(dev_type) };
+        auto next = async(launch::async, [&]() { process(batches[0], buffers[0]); });
+        for (size_t i = 0; i < batches.size(); ++i)
+        {
+            next.get();
+            auto& buffer = buffers[i % 2];
+            if (i + 1 < batches.size())
+            {
+                next = async(launch::async, [&, i]() { process(batches[i + 1], buffers[(i + 1) % 2]); });
+            }
+
+            map<string, Tensor> inputs;
+            inputs.emplace(input, buffer.UnsafeSharedInstance());
+            consume(i, sess.run(inputs));
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "siphon/session.h"
+#include "siphon/utils.h"
+
+#include <caffe2/core/tensor.h>
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace siphon
+{
+    class Siphon;
+
+    /*
+     * Image preprocessing into a float NCHW input described by value info:
+     * decode, resize shorter side, center crop, normalize by mean and std, and deinterleave channels into planes.
+     * Each image is written straight into its slice of the input tensor.
+     */
+    class Preprocessor
+    {
+    public:
+        using Tensor = caffe2::Tensor;
+
+        template <typename T>
+        using function = std::function<T>;
+
+        template <typename K, typename V>
+        using map = std::map<K, V>;
+
+        using string = std::string;
+
+        template <typename T>
+        using vector = std::vector<T>;
+
+        // Preprocess for input "input", or the only input in value info if empty.
+        SIPHON_API
+        Preprocessor(const Siphon& sp, const string& input = "");
+
+        // Decode encoded "images" into one batch in "tensor", resized as needed.
+        SIPHON_API
+        void process(const vector<string>& images, Tensor& tensor) const;
+
+        /*
+         * Run "sess" on every batch of encoded images in order.
+         * Batch i + 1 is preprocessed in background while batch i runs, alternating between two input buffers.
+         * "consume" gets index and outputs of every batch, which are only valid during the call.
+         */
+        SIPHON_API
+        void run(Session& sess, const vector<vector<string>>& batches, const function<void(size_t, const map<string, Tensor>&)>& consume) const;
+
+        // Shorter side to resize to before center crop. Resize to input size directly if not positive.
+        int resize = 256;
+
+        // Per channel in model order, applied on pixels scaled to [0, 1].
+        vector<float> mean{ 0.485f, 0.456f, 0.406f };
+        vector<float> stddev{ 0.229f, 0.224f, 0.225f };
+
+        // Channel order of model. OpenCV decodes in BGR.
+        bool rgb = true;
+
+    private:
+        string input;
+        int channels;
+        int height;
+        int width;
+        caffe2::DeviceType dev_type;
+    };
+}
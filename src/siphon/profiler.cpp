@@ -0,0 +1,193 @@
+#include "siphon/profiler.h"
+#include "siphon/json.h"
+
+#include <caffe2/core/logging.h>
+#include <caffe2/core/observer.h>
+#include <caffe2/core/operator.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <tuple>
+
+using namespace std;
+using namespace std::chrono;
+using namespace caffe2;
+
+namespace siphon
+{
+    class OperatorProfiler : public ObserverBase<OperatorBase>
+    {
+    public:
+        OperatorProfiler(OperatorBase* op, Profiler& prof, int net, int idx) : ObserverBase<OperatorBase>(op), prof(prof), net(net), idx(idx)
+        {
+        }
+
+        void Start() override
+        {
+            begin = Profiler::clock::now();
+        }
+
+        void Stop() override
+        {
+            prof.record(net, idx, begin, Profiler::clock::now());
+        }
+
+    private:
+        Profiler& prof;
+        const int net;
+        const int idx;
+        Profiler::clock::time_point begin;
+    };
+
+    SIPHON_API
+    Profiler::Profiler() : origin(clock::now())
+    {
+    }
+
+    SIPHON_API
+    void Profiler::attach(NetBase& net, const string& label)
+    {
+        int net_idx;
+        {
+            lock_guard<mutex> lck(mtx);
+            net_idx = static_cast<int>(net_labels.size());
+            net_labels.emplace_back(label);
+            op_infos.emplace_back();
+        }
+
+        const auto ops = net.GetOperators();
+        vector<OpInfo> infos;
+        for (size_t op_idx = 0; op_idx < ops.size(); ++op_idx)
+        {
+            auto& op = *ops[op_idx];
+            OpInfo info;
+            if (op.has_debug_def())
+            {
+                const auto& def = op.debug_def();
+                info.type = def.type();
+                info.name = def.has_name() && def.name().size() ? def.name() : def.output_size() ? def.output(0) : "";
+            }
+            infos.emplace_back(move(info));
+            op.AttachObserver(make_unique<OperatorProfiler>(&op, *this, net_idx, static_cast<int>(op_idx)));
+        }
+
+        {
+            lock_guard<mutex> lck(mtx);
+            op_infos[net_idx] = move(infos);
+        }
+
+        LOG(INFO) << "Attach profiler to " << ops.size() << " operators in \"" << label << "\".";
+    }
+
+    SIPHON_API
+    void Profiler::record(int net, int op, clock::time_point begin, clock::time_point end)
+    {
+        Record rec;
+        rec.net = net;
+        rec.op = op;
+        rec.begin_us = duration_cast<microseconds>(begin - origin).count();
+        rec.dur_us = duration_cast<microseconds>(end - begin).count();
+
+        lock_guard<mutex> lck(mtx);
+        rec.tid = tids.emplace(this_thread::get_id(), static_cast<int>(tids.size())).first->second;
+        records.emplace_back(rec);
+    }
+
+    SIPHON_API
+    string Profiler::summary() const
+    {
+        lock_guard<mutex> lck(mtx);
+
+        ostringstream buf;
+        buf << fixed << setprecision(3);
+        for (size_t net_idx = 0; net_idx < net_labels.size(); ++net_idx)
+        {
+            map<string, tuple<int64_t, int64_t>> by_type;
+            map<int, tuple<int64_t, int64_t>> by_op;
+            int64_t total = 0;
+            for (const auto& rec : records)
+            {
+                if (rec.net != static_cast<int>(net_idx))
+                    continue;
+                const auto& info = op_infos[net_idx][rec.op];
+                ++get<0>(by_type[info.type]);
+                get<1>(by_type[info.type]) += rec.dur_us;
+                ++get<0>(by_op[rec.op]);
+                get<1>(by_op[rec.op]) += rec.dur_us;
+                total += rec.dur_us;
+            }
+
+            vector<pair<int64_t, string>> types;
+            for (const auto& entry : by_type)
+                types.emplace_back(get<1>(entry.second), entry.first);
+            sort(types.rbegin(), types.rend());
+
+            vector<pair<int64_t, int>> ops;
+            for (const auto& entry : by_op)
+                ops.emplace_back(get<1>(entry.second), entry.first);
+            sort(ops.rbegin(), ops.rend());
+
+            buf << string(80, '=') << endl
+                << " " << net_labels[net_idx] << ": " << total / 1e3 << " ms in total" << endl
+                << string(80, '-') << endl
+                << " By op type:" << endl;
+            for (const auto& entry : types)
+            {
+                const auto& stat = by_type[entry.second];
+                buf << "    " << left << setw(32) << entry.second << right
+                    << setw(8) << get<0>(stat) << " calls"
+                    << setw(12) << entry.first / 1e3 << " ms"
+                    << setw(8) << (total ? 100.0 * entry.first / total : 0) << " %" << endl;
+            }
+            buf << string(80, '-') << endl
+                << " By op instance:" << endl;
+            for (const auto& entry : ops)
+            {
+                const auto& info = op_infos[net_idx][entry.second];
+                const auto& stat = by_op[entry.second];
+                buf << "    " << left << setw(6) << "#" + to_string(entry.second) << setw(26) << info.type << setw(24) << info.name << right
+                    << setw(12) << entry.first / 1e3 / max<int64_t>(get<0>(stat), 1) << " ms/call"
+                    << setw(8) << (total ? 100.0 * entry.first / total : 0) << " %" << endl;
+            }
+        }
+        buf << string(80, '=');
+        return buf.str();
+    }
+
+    SIPHON_API
+    void Profiler::save(const path& fn) const
+    {
+        lock_guard<mutex> lck(mtx);
+
+        LOG(INFO) << "Save " << records.size() << " operator records to " << fn << ".";
+
+        ofstream fout(fn);
+        CAFFE_ENFORCE(fout.is_open(), "Failed to open \"" + fn.string() + "\".");
+
+        fout << "{" << endl << "    \"traceEvents\": [" << endl;
+        bool first = true;
+        for (size_t net_idx = 0; net_idx < net_labels.size(); ++net_idx)
+        {
+            fout << (first ? "" : ",\n") << "        {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << net_idx
+                << ", \"args\": {\"name\": \"" << Json::escape(net_labels[net_idx]) << "\"}}";
+            first = false;
+        }
+        for (const auto& rec : records)
+        {
+            const auto& info = op_infos[rec.net][rec.op];
+            fout << (first ? "" : ",\n") << "        {\"name\": \"" << Json::escape(info.type)
+                << "\", \"cat\": \"" << Json::escape(net_labels[rec.net])
+                << "\", \"ph\": \"X\", \"ts\": " << rec.begin_us << ", \"dur\": " << rec.dur_us
+                << ", \"pid\": " << rec.net << ", \"tid\": " << rec.tid
+                << ", \"args\": {\"op\": " << rec.op << ", \"name\": \"" << Json::escape(info.name) << "\"}}";
+            first = false;
+        }
+        fout << endl << "    ]," << endl << "    \"displayTimeUnit\": \"ms\"" << endl << "}" << endl;
+
+        CAFFE_ENFORCE(fout, "Failied to write to \"" + fn.string() + "\".");
+    }
+}
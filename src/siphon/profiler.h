@@ -0,0 +1,86 @@
+#pragma once
+
+#include "siphon/utils.h"
+
+#include <caffe2/core/net.h>
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace siphon
+{
+    /*
+     * Per-operator timing collected by observers attached to predict nets.
+     * Records can be aggregated by op type and by op instance, or exported as Chrome trace.
+     */
+    class Profiler
+    {
+    public:
+        using NetBase = caffe2::NetBase;
+
+        using clock = std::chrono::steady_clock;
+
+        template <typename K, typename V>
+        using map = std::map<K, V>;
+
+        using mutex = std::mutex;
+
+        using path = std::filesystem::path;
+
+        using string = std::string;
+
+        template <typename T>
+        using vector = std::vector<T>;
+
+        struct Record
+        {
+            int net;
+            int op;
+            int tid;
+            int64_t begin_us;
+            int64_t dur_us;
+        };
+
+        SIPHON_API
+        Profiler();
+
+        /*
+         * Attach timing observers to all operators in "net".
+         * The profiler has to outlive the net.
+         */
+        SIPHON_API
+        void attach(NetBase& net, const string& label);
+
+        SIPHON_API
+        void record(int net, int op, clock::time_point begin, clock::time_point end);
+
+        SIPHON_API
+        string summary() const;
+
+        // Save in Chrome "about:tracing" / Perfetto JSON format.
+        SIPHON_API
+        void save(const path& fn) const;
+
+    private:
+        struct OpInfo
+        {
+            string type;
+            string name;
+        };
+
+        const clock::time_point origin;
+
+        mutable mutex mtx;
+
+        vector<string> net_labels;
+        vector<vector<OpInfo>> op_infos;
+        map<std::thread::id, int> tids;
+        vector<Record> records;
+    };
+}
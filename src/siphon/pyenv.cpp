@@ -2,13 +2,22 @@
 
 #include <caffe2/core/logging.h>
 
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/message_lite.h>
+
 #include <pybind11/embed.h>
 
 #include <exception>
+#include <future>
+#include <limits>
+#include <map>
 #include <mutex>
 #include <string>
+#include <thread>
 
 using namespace std;
+using namespace pybind11::literals;
 
 namespace siphon
 {
@@ -21,8 +30,6 @@ namespace siphon
         if (!inst)
         {
             inst = this;
-            LOG(INFO) << "Initialize embedded Python interpreter.";
-            py::initialize_interpreter();
         }
         ++inst->counter;
     }
@@ -34,8 +41,12 @@ namespace siphon
         CAFFE_ENFORCE(inst, "PyEnv instance does not exist.");
         if (!--inst->counter)
         {
-            LOG(INFO) << "Finalize embedded Python interpreter.";
-            py::finalize_interpreter();
+            if (interpreter.joinable())
+            {
+                done.set_value();
+                interpreter.join();
+                done = promise<void>();
+            }
             inst = nullptr;
         }
     }
@@ -43,12 +54,20 @@ namespace siphon
     SIPHON_API
     py::object PyEnv::import(const string& module)
     {
-        lock_guard<recursive_mutex> lck(mtx);
-        CAFFE_ENFORCE(inst, "PyEnv is not created");
+        start();
+        py::gil_scoped_acquire gil;
+
+        // Guarded by GIL.
+        auto& cached = modules[module];
+        if (cached)
+        {
+            return cached;
+        }
 
         try
         {
-            return py::module::import(module.c_str());
+            cached = py::module::import(module.c_str());
+            return cached;
         }
         catch (const exception& e)
         {
@@ -63,12 +82,125 @@ namespace siphon
 
     SIPHON_API
     void PyEnv::exec(function<void()> f)
+    {
+        start();
+        py::gil_scoped_acquire gil;
+        f();
+    }
+
+    SIPHON_HIDDEN
+    void PyEnv::start()
     {
         lock_guard<recursive_mutex> lck(mtx);
         CAFFE_ENFORCE(inst, "PyEnv is not created");
-        f();
+        if (interpreter.joinable())
+        {
+            return;
+        }
+
+        promise<void> ready;
+        auto initialized = ready.get_future();
+        interpreter = thread(&PyEnv::serve, ref(ready), done.get_future());
+        try
+        {
+            initialized.get();
+        }
+        catch (const exception&)
+        {
+            interpreter.join();
+            done = promise<void>();
+            throw;
+        }
+    }
+
+    SIPHON_HIDDEN
+    void PyEnv::serve(promise<void>& ready, future<void> finish)
+    {
+        PyThreadState* state = nullptr;
+        try
+        {
+            // Signals are left to the host process.
+            LOG(INFO) << "Initialize embedded Python interpreter.";
+            py::initialize_interpreter(false);
+            state = PyEval_SaveThread();
+        }
+        catch (const exception&)
+        {
+            ready.set_exception(current_exception());
+            return;
+        }
+        ready.set_value();
+
+        finish.wait();
+
+        PyEval_RestoreThread(state);
+        if (executor)
+        {
+            LOG(INFO) << "Shut down Python worker processes.";
+            executor.attr("shutdown")();
+            executor = py::object();
+        }
+        modules.clear();
+
+        LOG(INFO) << "Finalize embedded Python interpreter.";
+        py::finalize_interpreter();
+    }
+
+    SIPHON_HIDDEN
+    py::object PyEnv::pool()
+    {
+        // Guarded by GIL.
+        if (executor)
+        {
+            return executor;
+        }
+
+        LOG(INFO) << "Start " << workers << " Python worker processes.";
+
+        // Embedded interpreter reports the host binary as executable, so spawn the python of the same installation instead.
+        auto sys = import("sys");
+        const auto version = sys.attr("version_info");
+        auto ctx = import("multiprocessing").attr("get_context")("spawn");
+        ctx.attr("set_executable")(py::str("{}/bin/python{}.{}").format(sys.attr("exec_prefix"), version[py::int_(0)], version[py::int_(1)]));
+
+        executor = import("concurrent.futures").attr("ProcessPoolExecutor")("max_workers"_a = workers, "mp_context"_a = ctx);
+        return executor;
+    }
+
+    SIPHON_API
+    py::memoryview PyEnv::view(const string& buf)
+    {
+        auto ptr = PyMemoryView_FromMemory(const_cast<char*>(buf.data()), static_cast<Py_ssize_t>(buf.size()), PyBUF_READ);
+        if (!ptr)
+        {
+            throw py::error_already_set();
+        }
+        return py::reinterpret_steal<py::memoryview>(ptr);
+    }
+
+    SIPHON_API
+    void PyEnv::parse(const py::handle& buf, google::protobuf::MessageLite& msg)
+    {
+        Py_buffer view;
+        if (PyObject_GetBuffer(buf.ptr(), &view, PyBUF_SIMPLE))
+        {
+            throw py::error_already_set();
+        }
+
+        google::protobuf::io::ArrayInputStream input_stream(view.buf, static_cast<int>(view.len));
+        google::protobuf::io::CodedInputStream coded_stream(&input_stream);
+        coded_stream.SetTotalBytesLimit(numeric_limits<int>::max(), 512 << 20);
+        const auto ok = msg.ParseFromCodedStream(&coded_stream);
+
+        PyBuffer_Release(&view);
+        CAFFE_ENFORCE(ok, "Failed to parse " + msg.GetTypeName() + " from python.");
     }
 
     recursive_mutex PyEnv::mtx;
+    thread PyEnv::interpreter;
+    promise<void> PyEnv::done;
+    map<string, py::object> PyEnv::modules;
+    py::object PyEnv::executor;
     PyEnv* PyEnv::inst = nullptr;
+    int PyEnv::workers = 0;
 }
@@ -5,7 +5,17 @@
 #include <pybind11/embed.h>
 
 #include <functional>
+#include <future>
+#include <map>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace google::protobuf
+{
+    class MessageLite;
+}
 
 namespace siphon
 {
@@ -15,27 +25,97 @@ namespace siphon
         template <typename T>
         using function = std::function<T>;
 
+        template <typename K, typename V>
+        using map = std::map<K, V>;
+
         using recursive_mutex = std::recursive_mutex;
 
         using string = std::string;
 
+        using thread = std::thread;
+
+        template <typename T>
+        using future = std::future<T>;
+
+        template <typename T>
+        using promise = std::promise<T>;
+
+        /*
+         * Interpreter is shared by all instances.
+         * It is started on first use, not on construction, and finalized with the last instance.
+         * Both happen on a dedicated thread, since the thread of first use, e.g. a worker, may exit before.
+         */
         SIPHON_API
         PyEnv();
 
         SIPHON_API
         ~PyEnv();
 
+        // Import "module" once and cache it. GIL is acquired if not held.
         SIPHON_API
         static pybind11::object import(const string& module);
 
+        /*
+         * Run "f" holding GIL, from any thread.
+         * GIL is released by the interpreter thread after initialization, so C++ work of other threads runs concurrently.
+         * Keep "f" to the Python portion only, since Python work of all threads is serialized by GIL.
+         */
         SIPHON_API
         void exec(function<void()> f);
 
+        /*
+         * Call "f(args...)" in a worker process if "workers" is positive, or in this interpreter otherwise.
+         * "f" has to be picklable, e.g. a module-level function or a class method.
+         * Arguments and result are pickled across processes, and GIL is released while waiting.
+         * GIL has to be held by caller, e.g. inside exec().
+         */
+        template <typename... Args>
+        static pybind11::object call(const pybind11::object& f, Args&&... args)
+        {
+            if (workers <= 0)
+                return f(std::forward<Args>(args)...);
+            return pool().attr("submit")(f, std::forward<Args>(args)...).attr("result")();
+        }
+
+        /*
+         * Read-only memoryview over "buf" without copy.
+         * "buf" has to outlive the view and stay unchanged.
+         */
+        SIPHON_API
+        static pybind11::memoryview view(const string& buf);
+
+        // Parse "msg" in place from a python bytes-like object without copy.
+        SIPHON_API
+        static void parse(const pybind11::handle& buf, google::protobuf::MessageLite& msg);
+
         long long counter = 0;
 
         static PyEnv* inst;
 
+        // Number of Python worker processes for call(). Has to be set before first call.
+        static int workers;
+
     private:
+        // Start interpreter thread if not yet, and wait for interpreter initialization.
+        SIPHON_HIDDEN
+        static void start();
+
+        // Body of interpreter thread, holding interpreter from "ready" until "finish".
+        SIPHON_HIDDEN
+        static void serve(promise<void>& ready, future<void> finish);
+
+        // Process pool of call(), created on first use.
+        SIPHON_HIDDEN
+        static pybind11::object pool();
+
         static recursive_mutex mtx;
+
+        // Thread owning interpreter, and its signal to finalize.
+        static thread interpreter;
+        static promise<void> done;
+
+        static map<string, pybind11::object> modules;
+
+        static pybind11::object executor;
     };
 }
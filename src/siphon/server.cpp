@@ -0,0 +1,181 @@
+#include "siphon/server.h"
+#include "siphon/core.h"
+
+#include <caffe2/core/logging.h>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+using namespace std;
+using namespace std::chrono;
+using namespace caffe2;
+
+namespace siphon
+{
+    SIPHON_API
+    Server::Server(Siphon& sp, const string& lvl, int workers) : sp(sp), lvl(lvl), origin(clock::now())
+    {
+        CAFFE_ENFORCE_GT(workers, 0, "Need at least one worker per node.");
+
+        auto ids = sp.numa_replicas ? sp.replicate() : vector<int>();
+        if (ids.empty())
+        {
+            ids.emplace_back(-1);
+        }
+
+        // Workers of a node split its CPUs, and set up their sessions before serving, so that activations are allocated on the node as well.
+        vector<promise<void>> ready(ids.size() * workers);
+        auto next = ready.begin();
+        for (const auto id : ids)
+        {
+            nodes.emplace_back(make_unique<Node>());
+            auto& node = *nodes.back();
+            node.id = id;
+            for (int i = 0; i < workers; ++i)
+                node.workers.emplace_back(&Server::work, this, ref(node), i, workers, ref(*next++));
+        }
+
+        try
+        {
+            for (auto& worker : ready)
+                worker.get_future().get();
+        }
+        catch (const exception&)
+        {
+            stop();
+            throw;
+        }
+
+        LOG(INFO) << "Serve predict net \"" << lvl << "\" with " << workers << " worker(s) on each of " << nodes.size() << " node(s).";
+    }
+
+    SIPHON_API
+    Server::~Server()
+    {
+        stop();
+    }
+
+    SIPHON_HIDDEN
+    void Server::stop()
+    {
+        if (stopped)
+        {
+            return;
+        }
+        stopped = true;
+
+        for (auto& node : nodes)
+        {
+            {
+                lock_guard<mutex> lck(node->mtx);
+                node->tasks.emplace_back(nullptr);
+            }
+            node->cv.notify_all();
+            for (auto& worker : node->workers)
+                worker.join();
+        }
+    }
+
+    SIPHON_HIDDEN
+    void Server::work(Node& node, int slot, int slots, promise<void>& ready)
+    {
+        unique_ptr<Session> sess;
+        try
+        {
+            sess = sp.session(lvl, node.id, slot, slots);
+            sess->prepare();
+            ready.set_value();
+        }
+        catch (const exception&)
+        {
+            ready.set_exception(current_exception());
+        }
+
+        for (;;)
+        {
+            Task* task = nullptr;
+            {
+                unique_lock<mutex> lck(node.mtx);
+                node.cv.wait(lck, [&]() { return node.tasks.size(); });
+
+                // Null task stops all workers of the node, so it is left in queue.
+                task = node.tasks.front();
+                if (!task)
+                    return;
+                node.tasks.pop_front();
+            }
+
+            // Task is owned by the caller, which may return once outputs are set.
+            const auto queued = task->queued;
+            const auto begin = clock::now();
+            try
+            {
+                CAFFE_ENFORCE(sess, "Session of predict net \"" + lvl + "\" failed to create.");
+                map<string, Tensor> outputs;
+                for (const auto& output : sess->run(*task->inputs))
+                    outputs.emplace(output.first, output.second.Clone());
+                task->outputs.set_value(move(outputs));
+            }
+            catch (const exception&)
+            {
+                task->outputs.set_exception(current_exception());
+            }
+            const auto end = clock::now();
+            node.busy_us += duration_cast<microseconds>(end - begin).count();
+            node.latency_us += duration_cast<microseconds>(end - queued).count();
+            ++node.done;
+            --node.load;
+        }
+    }
+
+    SIPHON_API
+    map<string, Tensor> Server::run(const map<string, Tensor>& inputs)
+    {
+        auto& node = **min_element(nodes.begin(), nodes.end(), [](const unique_ptr<Node>& a, const unique_ptr<Node>& b)
+            {
+                return a->load < b->load;
+            });
+        ++node.load;
+
+        Task task;
+        task.inputs = &inputs;
+        task.queued = clock::now();
+        auto outputs = task.outputs.get_future();
+        {
+            lock_guard<mutex> lck(node.mtx);
+            node.tasks.emplace_back(&task);
+        }
+        node.cv.notify_one();
+        return outputs.get();
+    }
+
+    SIPHON_API
+    string Server::report() const
+    {
+        const auto elapsed = duration<double>(clock::now() - origin).count();
+
+        ostringstream buf;
+        buf << fixed << setprecision(3);
+        buf << left << setw(8) << " node" << right
+            << setw(10) << "workers"
+            << setw(12) << "requests"
+            << setw(12) << "QPS"
+            << setw(14) << "service (ms)"
+            << setw(14) << "latency (ms)" << endl;
+        for (const auto& node : nodes)
+        {
+            const auto done = node->done.load();
+            buf << left << setw(8) << " " + (node->id < 0 ? string("all") : to_string(node->id)) << right
+                << setw(10) << node->workers.size()
+                << setw(12) << done
+                << setw(12) << (elapsed > 0 ? done / elapsed : 0)
+                << setw(14) << (done ? node->busy_us.load() / 1e3 / done : 0)
+                << setw(14) << (done ? node->latency_us.load() / 1e3 / done : 0) << endl;
+        }
+        return buf.str();
+    }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "siphon/session.h"
+#include "siphon/utils.h"
+
+#include <caffe2/core/tensor.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace siphon
+{
+    class Siphon;
+
+    /*
+     * Thread-safe inference over worker threads, each owning a session.
+     * With "numa_replicas" of the Siphon object, every NUMA node gets a weight replica and its own workers pinned to it.
+     * Requests are dispatched to the node with the fewest outstanding requests.
+     * The Siphon object has to outlive the server.
+     */
+    class Server
+    {
+    public:
+        using Tensor = caffe2::Tensor;
+
+        using clock = std::chrono::steady_clock;
+
+        using condition_variable = std::condition_variable;
+
+        template <typename T>
+        using deque = std::deque<T>;
+
+        template <typename K, typename V>
+        using map = std::map<K, V>;
+
+        using mutex = std::mutex;
+
+        template <typename T>
+        using promise = std::promise<T>;
+
+        using string = std::string;
+
+        template <typename T>
+        using unique_ptr = std::unique_ptr<T>;
+
+        template <typename T>
+        using vector = std::vector<T>;
+
+        // Serve predict net at level "lvl" with "workers" threads per node.
+        SIPHON_API
+        Server(Siphon& sp, const string& lvl = "pred", int workers = 1);
+
+        SIPHON_API
+        ~Server();
+
+        // Outputs are copies owned by caller.
+        SIPHON_API
+        map<string, Tensor> run(const map<string, Tensor>& inputs);
+
+        // Requests, throughput, service time and latency including queueing, by node since construction.
+        SIPHON_API
+        string report() const;
+
+    private:
+        struct Task
+        {
+            const map<string, Tensor>* inputs;
+            promise<map<string, Tensor>> outputs;
+            clock::time_point queued;
+        };
+
+        struct Node
+        {
+            // NUMA node, or -1 if weights are shared without replica.
+            int id;
+
+            mutex mtx;
+            condition_variable cv;
+            deque<Task*> tasks;
+            vector<std::thread> workers;
+
+            std::atomic<int> load{ 0 };
+            std::atomic<int64_t> done{ 0 };
+            std::atomic<int64_t> busy_us{ 0 };
+            std::atomic<int64_t> latency_us{ 0 };
+        };
+
+        SIPHON_HIDDEN
+        void work(Node& node, int slot, int slots, promise<void>& ready);
+
+        // Stop and join all workers.
+        SIPHON_HIDDEN
+        void stop();
+
+        const Siphon& sp;
+        const string lvl;
+        const clock::time_point origin;
+
+        vector<unique_ptr<Node>> nodes;
+        bool stopped = false;
+    };
+}
@@ -0,0 +1,358 @@
+#include "siphon/session.h"
+#include "siphon/affinity.h"
+#include "siphon/core.h"
+
+#include <caffe2/core/logging.h>
+#include <caffe2/core/types.h>
+#include <caffe2/utils/proto_utils.h>
+
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace caffe2;
+
+namespace siphon
+{
+    SIPHON_API
+    Session::Session(const Siphon& sp, const NetDef& net_def) : Session(sp, vector<Bucket>{ { net_def, {} } })
+    {
+    }
+
+    SIPHON_API
+    Session::Session(const Siphon& sp, const vector<Bucket>& buckets) : Session(sp, buckets, sp.ws, sp.cpu_set)
+    {
+    }
+
+    SIPHON_API
+    Session::Session(const Siphon& sp, const vector<Bucket>& buckets, const Workspace& weights, const vector<int>& cpus, int sharing) : sp(sp), weights(weights), cpus(cpus)
+    {
+        CAFFE_ENFORCE(buckets.size(), "Session needs at least one predict net.");
+        CAFFE_ENFORCE_GT(sharing, 0, "Session needs at least one share of CPUs.");
+
+        for (const auto& bucket : buckets)
+        {
+            variants.emplace_back(make_unique<Variant>(bucket, &weights));
+            configure(variants.back()->bucket.net_def);
+        }
+
+        // Inputs with leading dimension varying among buckets carry the batch.
+        for (const auto& info : sp.value_info)
+        {
+            const auto dims = input_dims(*variants.front(), info.first);
+            for (const auto& var : variants)
+            {
+                const auto other = input_dims(*var, info.first);
+                if (dims.size() && other.size() && dims[0] != other[0])
+                    batched.insert(info.first);
+            }
+        }
+
+        const auto cores = cpus.size() ? static_cast<int>(cpus.size()) : static_cast<int>(thread::hardware_concurrency());
+        intra_op_threads = sp.intra_op_threads > 0 ? sp.intra_op_threads : max(cores / (inter_op_threads * sharing), 1);
+        if (inter_op_threads > 1)
+        {
+            LOG(INFO) << "Run " << inter_op_threads << " inter-op workers with " << intra_op_threads << " intra-op threads each on " << cores << " cores.";
+#ifdef _OPENMP
+            // Workers are created by Caffe2, so only OpenMP defaults apply to them.
+            if (omp_get_max_threads() > intra_op_threads)
+                LOG(WARNING) << "Executor workers use " << omp_get_max_threads() << " OpenMP threads by default. Set OMP_NUM_THREADS=" << intra_op_threads << " to avoid oversubscription.";
+#endif
+        }
+    }
+
+    SIPHON_HIDDEN
+    void Session::configure(NetDef& net_def)
+    {
+        if (sp.net_type.size() && sp.net_type != net_def.type())
+        {
+            if (sp.net_type != "simple" && ArgumentHelper(net_def).HasArgument(Siphon::memory_planned_arg))
+                LOG(WARNING) << "Predict net \"" << net_def.name() << "\" is memory-planned. Keep it simple instead of " << sp.net_type << ".";
+            else
+                net_def.set_type(sp.net_type);
+        }
+        if (sp.num_workers > 0)
+        {
+            net_def.set_num_workers(sp.num_workers);
+        }
+        if (net_def.type().size() && net_def.type() != "simple")
+        {
+            inter_op_threads = max(inter_op_threads, max(net_def.num_workers(), 1));
+        }
+    }
+
+    SIPHON_HIDDEN
+    void Session::bind()
+    {
+        bound = this_thread::get_id();
+        if (cpus.size())
+        {
+            pin_thread(cpus);
+        }
+#ifdef _OPENMP
+        omp_set_num_threads(intra_op_threads);
+#endif
+    }
+
+    SIPHON_HIDDEN
+    void Session::prepare(Variant& var)
+    {
+        const auto& net_def = var.bucket.net_def;
+
+        // Empty blobs of inputs for net creation, which are set by each run.
+        for (const auto& name : net_def.external_input())
+            if (!var.ws.HasBlob(name))
+                var.ws.CreateBlob(name);
+
+        const auto shapes = sp.peak_shapes(net_def, var.bucket.dims);
+        preallocate(var, shapes);
+
+        // Padding applies only with buckets. Outputs are batch-major if their leading dimension grows with that of inputs.
+        if (variants.size() > 1)
+        {
+            auto dims = var.bucket.dims;
+            for (auto& entry : dims)
+                if (entry.second.size())
+                    ++entry.second[0];
+            const auto grown = sp.peak_shapes(net_def, dims);
+            for (const auto& name : net_def.external_output())
+            {
+                const auto base = shapes.find(name);
+                const auto probe = grown.find(name);
+                if (base != shapes.end() && probe != grown.end() && base->second.dims_size() && probe->second.dims_size()
+                    && probe->second.dims(0) == base->second.dims(0) + 1)
+                {
+                    var.batch_major.insert(name);
+                }
+            }
+        }
+
+        create_net(var);
+        var.prepared = true;
+    }
+
+    SIPHON_HIDDEN
+    vector<int> Session::input_dims(const Variant& var, const string& name) const
+    {
+        const auto dims = var.bucket.dims.find(name);
+        if (dims != var.bucket.dims.end())
+            return dims->second;
+        const auto info = sp.value_info.find(name);
+        return info == sp.value_info.end() ? vector<int>() : info->second.dims;
+    }
+
+    SIPHON_HIDDEN
+    Session::Variant& Session::route(const map<string, Tensor>& inputs)
+    {
+        if (variants.size() == 1)
+        {
+            return *variants.front();
+        }
+
+        Variant* best = nullptr;
+        int64_t best_numel = 0;
+        for (const auto& var : variants)
+        {
+            auto fits = true;
+            int64_t numel = 0;
+            for (const auto& input : inputs)
+            {
+                const auto dims = input_dims(*var, input.first);
+                const auto sizes = input.second.sizes();
+                fits = fits && dims.size() && dims.size() == sizes.size() && sizes[0] <= dims[0]
+                    && equal(sizes.begin() + 1, sizes.end(), dims.begin() + 1);
+                int64_t size = 1;
+                for (const auto dim : dims)
+                    size *= dim;
+                numel += size;
+            }
+            if (fits && (!best || numel < best_numel))
+            {
+                best = var.get();
+                best_numel = numel;
+            }
+        }
+
+        CAFFE_ENFORCE(best, "No shape bucket fits inputs of predict net \"" + variants.front()->bucket.net_def.name() + "\".");
+        return *best;
+    }
+
+    SIPHON_HIDDEN
+    void Session::preallocate(Variant& var, const map<string, TensorShape>& shapes)
+    {
+        struct Slot
+        {
+            string name;
+            TensorShape shape;
+            int64_t offset;
+            int64_t size;
+        };
+
+        const auto& net_def = var.bucket.net_def;
+
+        // Int8 ops replace blob content with their own tensor type.
+        set<string> skipped(net_def.external_input().begin(), net_def.external_input().end());
+        for (const auto& op : net_def.op())
+            if (!op.type().compare(0, 4, "Int8") && op.type() != "Int8Dequantize")
+                skipped.insert(op.output().begin(), op.output().end());
+
+        vector<Slot> slots;
+        int64_t total = 0;
+        for (const auto& entry : shapes)
+        {
+            const auto& shape = entry.second;
+            const auto size = Siphon::nbytes(shape);
+            if (skipped.count(entry.first) || weights.HasBlob(entry.first) || shape.data_type() == TensorProto_DataType_STRING || !size)
+            {
+                continue;
+            }
+            const auto offset = (total + arena_alignment - 1) / arena_alignment * arena_alignment;
+            slots.push_back({ entry.first, shape, offset, size });
+            total = offset + size;
+        }
+
+        if (slots.empty())
+        {
+            return;
+        }
+
+        var.arena = Tensor(vector<int64_t>{ total }, sp.dev_type);
+        const auto base = var.arena.mutable_data<uint8_t>();
+        for (const auto& slot : slots)
+        {
+            auto& tensor = *BlobGetMutableTensor(var.ws.CreateBlob(slot.name), sp.dev_type);
+            tensor.Resize(vector<int64_t>(slot.shape.dims().begin(), slot.shape.dims().end()));
+            tensor.ShareExternalPointer(base + slot.offset, DataTypeToTypeMeta(slot.shape.data_type()), slot.size);
+        }
+
+        LOG(INFO) << "Preallocate " << slots.size() << " activations of predict net \"" << net_def.name() << "\" in " << total << " bytes.";
+    }
+
+    SIPHON_HIDDEN
+    void Session::create_net(Variant& var)
+    {
+        const auto& net_def = var.bucket.net_def;
+        LOG(INFO) << "Create predict net \"" << net_def.name() << "\" in session.";
+        var.net = var.ws.CreateNet(net_def);
+        CAFFE_ENFORCE(var.net, "Failed to create predict net \"" + net_def.name() + "\".");
+        if (prof)
+        {
+            prof->attach(*var.net, net_def.name());
+        }
+    }
+
+    SIPHON_API
+    map<string, Tensor> Session::run(const map<string, Tensor>& inputs)
+    {
+        // Pin before creating nets, so that executor workers and first touch of activations land on the CPU set.
+        if (bound != this_thread::get_id())
+        {
+            bind();
+        }
+
+        auto& var = route(inputs);
+        if (!var.prepared)
+        {
+            prepare(var);
+        }
+        const auto& net_def = var.bucket.net_def;
+
+        // Actual and padded leading dimension, if any input is padded. Inputs fit the bucket after routing.
+        int64_t batch = 0;
+        int64_t padded_batch = 0;
+        if (variants.size() > 1)
+        {
+            for (const auto& input : inputs)
+            {
+                const auto dims = input_dims(var, input.first);
+                if (batched.count(input.first) && input.second.size(0) < dims[0])
+                {
+                    batch = input.second.size(0);
+                    padded_batch = dims[0];
+                    break;
+                }
+            }
+        }
+
+        for (const auto& input : inputs)
+        {
+            CAFFE_ENFORCE(sp.value_info.empty() || sp.value_info.count(input.first), "Input \"" + input.first + "\" is not found in value info.");
+            const auto blob = var.ws.CreateBlob(input.first);
+            const auto dims = input_dims(var, input.first);
+            const auto& tensor = input.second;
+
+            // Batch inputs have to be padded together, also those already filling the bucket.
+            CAFFE_ENFORCE(!padded_batch || !batched.count(input.first) || (batch == tensor.size(0) && padded_batch == dims[0]), "Inputs of predict net \"" + net_def.name() + "\" have inconsistent batch sizes.");
+            if (variants.size() == 1 || tensor.size(0) == dims[0])
+            {
+                BlobSetTensor(blob, tensor.UnsafeSharedInstance());
+                continue;
+            }
+
+            auto pad = var.pads.find(input.first);
+            if (pad == var.pads.end())
+            {
+                pad = var.pads.emplace(input.first, Tensor(dims, sp.dev_type)).first;
+            }
+            const auto data = static_cast<uint8_t*>(pad->second.raw_mutable_data(tensor.dtype()));
+            if (tensor.nbytes())
+                memcpy(data, tensor.raw_data(), tensor.nbytes());
+            memset(data + tensor.nbytes(), 0, pad->second.nbytes() - tensor.nbytes());
+            BlobSetTensor(blob, pad->second.UnsafeSharedInstance());
+        }
+
+        CAFFE_ENFORCE(var.net->Run(), "Failed to run predict net \"" + net_def.name() + "\".");
+
+        map<string, Tensor> outputs;
+        for (const auto& name : net_def.external_output())
+        {
+            const auto blob = var.ws.GetBlob(name);
+            CAFFE_ENFORCE(blob, "Output blob \"" + name + "\" doesn't exist.");
+            const auto& tensor = BlobGetTensor(*blob, sp.dev_type);
+            if (!padded_batch || !var.batch_major.count(name) || tensor.size(0) != padded_batch)
+            {
+                outputs.emplace(name, tensor.UnsafeSharedInstance());
+                continue;
+            }
+
+            // Leading rows of padded output, aliasing workspace without copy.
+            auto sizes = tensor.sizes().vec();
+            sizes[0] = batch;
+            Tensor view(sizes, sp.dev_type);
+            view.ShareExternalPointer(const_cast<void*>(tensor.raw_data()), tensor.dtype(), tensor.nbytes() / padded_batch * batch);
+            outputs.emplace(name, move(view));
+        }
+        return outputs;
+    }
+
+    SIPHON_API
+    void Session::prepare()
+    {
+        if (bound != this_thread::get_id())
+        {
+            bind();
+        }
+        for (const auto& var : variants)
+            if (!var->prepared)
+                prepare(*var);
+    }
+
+    SIPHON_API
+    void Session::attach(Profiler& prof)
+    {
+        CAFFE_ENFORCE(!this->prof, "Profiler has been attached to session already.");
+        this->prof = &prof;
+        for (const auto& var : variants)
+            if (var->net)
+                prof.attach(*var->net, var->bucket.net_def.name());
+    }
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include "siphon/profiler.h"
+#include "siphon/utils.h"
+
+#include <caffe2/core/net.h>
+#include <caffe2/core/workspace.h>
+
+#include <cstdint>
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace siphon
+{
+    class Siphon;
+
+    /*
+     * Inference session owning a lightweight workspace for activations only.
+     * Weights are shared read-only from the workspace of the Siphon object, which has to outlive the session.
+     * Activations with inferable shapes are preallocated in one arena, so that running doesn't allocate.
+     * With multiple shape buckets, each run goes to the smallest bucket fitting all inputs, whose arena and net are created on first use.
+     * Inputs are zero-padded along the leading dimension up to the bucket, and batch-major outputs are sliced back.
+     * Executor, CPU pinning and intra-op threads follow settings of the Siphon object at construction.
+     * Each session is meant to be used by one thread at a time, which is pinned on its first run or prepare().
+     */
+    class Session
+    {
+    public:
+        using NetBase = caffe2::NetBase;
+
+        using NetDef = caffe2::NetDef;
+
+        using Tensor = caffe2::Tensor;
+
+        using Workspace = caffe2::Workspace;
+
+        template <typename K, typename V>
+        using map = std::map<K, V>;
+
+        template <typename T>
+        using set = std::set<T>;
+
+        using string = std::string;
+
+        template <typename T>
+        using unique_ptr = std::unique_ptr<T>;
+
+        template <typename T>
+        using vector = std::vector<T>;
+
+        // Predict net specialized for input dims, which override value info. Empty dims to use value info.
+        struct Bucket
+        {
+            NetDef net_def;
+            map<string, vector<int>> dims;
+        };
+
+        SIPHON_API
+        Session(const Siphon& sp, const NetDef& net_def);
+
+        SIPHON_API
+        Session(const Siphon& sp, const vector<Bucket>& buckets);
+
+        /*
+         * Share weights from "weights" instead, e.g. a replica of the Siphon workspace, and pin to "cpus" instead.
+         * "sharing" sessions run concurrently on "cpus", so default intra-op threads are divided among them.
+         */
+        SIPHON_API
+        Session(const Siphon& sp, const vector<Bucket>& buckets, const Workspace& weights, const vector<int>& cpus, int sharing = 1);
+
+        /*
+         * Inputs are shared with workspace without copy.
+         * Outputs alias blobs in workspace and are only valid until next run.
+         */
+        SIPHON_API
+        map<string, Tensor> run(const map<string, Tensor>& inputs);
+
+        /*
+         * Set up activations and nets of all buckets ahead of time, on calling thread, which is bound as by run().
+         * Otherwise each bucket is set up by its first run. Call it on the thread which is going to run the session.
+         */
+        SIPHON_API
+        void prepare();
+
+        // Time every operator of the predict net with "prof", which has to outlive the session.
+        SIPHON_API
+        void attach(Profiler& prof);
+
+    private:
+        struct Variant
+        {
+            explicit Variant(const Bucket& bucket, const Workspace* shared) : bucket(bucket), ws(shared)
+            {
+            }
+
+            Bucket bucket;
+
+            // Backing memory of activations, which has to outlive workspace.
+            Tensor arena;
+
+            // Zero-padded copies of inputs smaller than the bucket.
+            map<string, Tensor> pads;
+
+            // Outputs whose leading dimension follows the batch of inputs, which are sliced after padding.
+            set<string> batch_major;
+
+            Workspace ws;
+            NetBase* net = nullptr;
+            bool prepared = false;
+        };
+
+        // Apply executor settings to "net_def".
+        SIPHON_HIDDEN
+        void configure(NetDef& net_def);
+
+        // Pin calling thread and set its intra-op threads.
+        SIPHON_HIDDEN
+        void bind();
+
+        // Create activations and net of "var" on the bound thread.
+        SIPHON_HIDDEN
+        void prepare(Variant& var);
+
+        // Dims of input "name" in "var", or empty if unknown.
+        SIPHON_HIDDEN
+        vector<int> input_dims(const Variant& var, const string& name) const;
+
+        // Smallest variant fitting all inputs by leading dimension.
+        SIPHON_HIDDEN
+        Variant& route(const map<string, Tensor>& inputs);
+
+        // Lay out activations at their peak sizes in "shapes" in one aligned arena.
+        SIPHON_HIDDEN
+        void preallocate(Variant& var, const map<string, caffe2::TensorShape>& shapes);
+
+        SIPHON_HIDDEN
+        void create_net(Variant& var);
+
+        const Siphon& sp;
+
+        const Workspace& weights;
+        vector<int> cpus;
+
+        vector<unique_ptr<Variant>> variants;
+
+        // Inputs whose leading dimension is the batch of buckets.
+        set<string> batched;
+
+        Profiler* prof = nullptr;
+
+        // Most inter-op workers among variants, and intra-op threads per worker.
+        int inter_op_threads = 1;
+        int intra_op_threads = 1;
+
+        // Thread which has been bound last.
+        std::thread::id bound;
+
+        static const int64_t arena_alignment = 64;
+    };
+}